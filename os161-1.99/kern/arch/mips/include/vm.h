@@ -114,12 +114,15 @@ void afterinit (void);
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
+struct semaphore;
+
 struct tlbshootdown {
 	/*
 	 * Change this to what you need for your VM design.
 	 */
 	struct addrspace *ts_addrspace;
 	vaddr_t ts_vaddr;
+	struct semaphore *ts_done;	/* V'd when handled, if not NULL */
 };
 
 #define TLBSHOOTDOWN_MAX 16
@@ -36,6 +36,7 @@
 #include <current.h>
 #include <syscall.h>
 #include "opt-A2.h"
+#include "opt-A3.h"
 #include <proc.h>
 #include <addrspace.h>
 
@@ -137,6 +138,21 @@ syscall(struct trapframe *tf)
 	case SYS_execv:
 		err = sys_execv((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1);
 		break;
+#if OPT_A3
+	case SYS_sbrk:
+		err = sys_sbrk((intptr_t)tf->tf_a0, (vaddr_t *)&retval);
+		break;
+	case SYS_mmap:
+		err = sys_mmap(tf, (vaddr_t *)&retval);
+		break;
+	case SYS_munmap:
+		err = sys_munmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1);
+		break;
+	case SYS_msync:
+		err = sys_msync((userptr_t)tf->tf_a0, (size_t)tf->tf_a1,
+				(int)tf->tf_a2);
+		break;
+#endif /* OPT_A3 */
 #endif // UW
 
 	    /* Add stuff here */
@@ -59,6 +59,13 @@
 vaddr_t cpustacks[MAXCPUS];
 vaddr_t cputhreads[MAXCPUS];
 
+/*
+ * Likewise, the page directory of the address space each CPU has
+ * active (0 if none), for the fast-path TLB refill in the UTLB
+ * exception handler. Maintained by the VM system.
+ */
+vaddr_t cpupagetables[MAXCPUS];
+
 /*
  * Do machine-dependent initialization of the cpu structure or things
  * associated with a new cpu. Note that we're not running on the new
@@ -35,187 +35,1954 @@
 #include <proc.h>
 #include <current.h>
 #include <mips/tlb.h>
+#include <mips/trapframe.h>
 #include <addrspace.h>
 #include <vm.h>
 #include "opt-A3.h"
 #include <coremap.h>
+#if OPT_A3
+#include <cpu.h>
+#include <thread.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <uw-vmstats.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <textcache.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
+#include <kmemcache.h>
+#endif /* OPT_A3 */
+
+/*
+ * Dumb MIPS-only "VM system" that is intended to only be just barely
+ * enough to struggle off the ground.
+ */
+
+/* under dumbvm, always have 48k of user stack */
+#define DUMBVM_STACKPAGES    12
+
+#if OPT_A3
+/*
+ * The A3 stack starts at one page and grows down on demand, up to the
+ * address space's stack limit (as_stackmax, in pages; new processes
+ * get vm_stacklimit, which the "stack" menu command sets). It never
+ * grows to within VM_STACKGUARD pages of the next region down, so a
+ * runaway stack faults instead of running into the heap or data.
+ * Likewise the heap may not grow to within VM_STACKGUARD pages of the
+ * lowest address the stack is allowed to reach, or of the lowest mmap
+ * region; mmap regions go below the stack's reach, above the heap.
+ */
+#define VM_STACKLIMIT        512
+#define VM_STACKGUARD        16
+
+static unsigned vm_stacklimit = VM_STACKLIMIT;
+#endif /* OPT_A3 */
+
+/*
+ * Wrap rma_stealmem in a spinlock.
+ */
+static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
+
+#if OPT_A3
+/* Set once the coremap owns physical memory. */
+static volatile bool coremap_ready = false;
+
+/* Evictions getppages may try per page it wants before giving up. */
+#define VM_EVICT_RETRIES     4
+
+/* Victims vm_evict looks at before deciding nothing can go. */
+#define VM_EVICT_CANDIDATES  32
+
+/*
+ * Batches of reference bits vm_evict lets the clock clear before it
+ * stops giving second chances. Pages that keep faulting back in as
+ * fast as the hand clears them would otherwise keep it going forever.
+ */
+#define VM_EVICT_SWEEPS      64
+
+/* One page-out at a time; see vm_evict. */
+static struct lock *evict_lock;
+
+/*
+ * TLB shootdowns (see tlb_shootdown_pages): one sender at a time, and
+ * the targets' acknowledgements.
+ */
+static struct lock *shootdown_lock;
+static struct semaphore *shootdown_sem;
+
+/*
+ * Address space IDs. An address space is given a TLB PID the first
+ * time it is activated in each generation, and PIDs are never reused
+ * within a generation, so TLB entries of several address spaces can
+ * stay in the TLB across switches. When the PIDs run out a new
+ * generation starts, and each cpu flushes its TLB the next time it
+ * activates an address space. PID 0 is not handed out.
+ */
+#define ASID_FIRST  1
+
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static unsigned asid_next = ASID_FIRST;
+static unsigned asid_gen = 1;
+static bool asid_tagging = true;	/* false: flush on every switch */
+
+/* vmstats at the last vm_setasids, for vm_printasidstats. */
+static unsigned asid_basefaults, asid_baseswitches, asid_baserollovers;
+static unsigned asid_baserefills;
+
+/* TLB misses served by mips_utlb_refill without reaching vm_fault. */
+unsigned vm_fastrefills;
+
+/*
+ * Fault-around: on each miss vm_fault handles, also load the TLB with
+ * up to vm_faultaround following resident pages of the same region.
+ * 0 (the default) turns it off. Set by the "fa" menu command.
+ */
+#define VM_FAULTAROUND_MAX  16
+
+static unsigned vm_faultaround = 0;
+
+/* Counters at the last vm_setfaultaround, for vm_printfaultaround. */
+static unsigned fa_basefaults, fa_baserefills, fa_baseloads;
+
+/*
+ * Where address spaces come from. A free one keeps its as_lock, so
+ * as_create does not have to make a new lock each time.
+ */
+static struct kmem_cache *as_cache;
+static int as_ctor(void *obj);
+static void as_dtor(void *obj);
+
+static bool vm_can_evict(void);
+static int vm_evict(void);
+static void tlb_shootdown_pages(struct addrspace *as, const vaddr_t *vas,
+				unsigned nvas);
+#endif /* OPT_A3 */
+
+void
+vm_bootstrap(void)
+{
+#if OPT_A3
+	coremap_bootstrap();
+	coremap_ready = true;
+	vmstats_init();
+
+	evict_lock = lock_create("evict");
+	shootdown_lock = lock_create("shootdown");
+	shootdown_sem = sem_create("shootdown", 0);
+	if (evict_lock == NULL || shootdown_lock == NULL ||
+	    shootdown_sem == NULL) {
+		panic("vm_bootstrap: out of memory\n");
+	}
+	swap_bootstrap();
+	textcache_bootstrap();
+	coremap_zero_bootstrap();
+
+	as_cache = kmem_cache_create("addrspace", sizeof(struct addrspace),
+				     as_ctor, as_dtor);
+	if (as_cache == NULL) {
+		panic("vm_bootstrap: out of memory\n");
+	}
+#endif /* OPT_A3 */
+}
+
+/*
+ * Get NPAGES contiguous frames for OWNER (NULL for the kernel).
+ */
+static
+paddr_t
+getppages(unsigned long npages, struct addrspace *owner)
+{
+	paddr_t addr;
+#if OPT_A3
+	unsigned long tries;
+
+	if (coremap_ready) {
+		/*
+		 * Out of frames: push user pages out to swap and try
+		 * again. A multi-page run may need several evictions
+		 * before the freed frames coalesce, so keep at it for
+		 * a while, but not forever.
+		 */
+		for (tries = 0; ; tries++) {
+			addr = coremap_alloc(npages, owner);
+			if (addr != 0 || tries >= npages * VM_EVICT_RETRIES) {
+				break;
+			}
+			if (!vm_can_evict() || vm_evict() != 0) {
+				break;
+			}
+		}
+		return addr;
+	}
+#endif /* OPT_A3 */
+	(void)owner;
+
+	spinlock_acquire(&stealmem_lock);
+
+	addr = ram_stealmem(npages);
+
+	spinlock_release(&stealmem_lock);
+	return addr;
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t 
+alloc_kpages(int npages)
+{
+	paddr_t pa;
+	pa = getppages(npages, NULL);
+	if (pa==0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void 
+free_kpages(vaddr_t addr)
+{
+#if OPT_A3
+	/* Frees exactly the block alloc_kpages handed out. */
+	coremap_free(K_TO_P(addr));
+#else
+	/* nothing - leak the memory. */
+
+	(void)addr;
+#endif /* OPT_A3 */
+}
+
+#if OPT_A3
+
+/*
+ * TLB PID of address space AS, in place for entryhi.
+ */
+static
+uint32_t
+as_pid(struct addrspace *as)
+{
+	return as->as_asid << TLBHI_PIDSHIFT;
+}
+
+/*
+ * Mask of the cpus (by c_number) whose TLBs may hold entries for AS,
+ * namely those that have activated it since it got its current PID.
+ */
+static
+uint32_t
+as_cpus(struct addrspace *as)
+{
+	uint32_t cpus;
+
+	spinlock_acquire(&asid_lock);
+	cpus = as->as_cpus;
+	spinlock_release(&asid_lock);
+	return cpus;
+}
+
+/*
+ * Drop this cpu's TLB entry for VA in AS, if it has one. If AS is
+ * NULL, drop the entries for VA under every PID.
+ */
+static
+void
+tlb_invalidate_page(struct addrspace *as, vaddr_t va)
+{
+	uint32_t ehi, elo;
+	int i, spl;
+
+	va &= PAGE_FRAME;
+	spl = splhigh();
+	if (as != NULL) {
+		i = tlb_probe(va | as_pid(as), 0);
+		if (i >= 0) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
+	}
+	else {
+		for (i=0; i<NUM_TLB; i++) {
+			tlb_read(&ehi, &elo, i);
+			if ((ehi & TLBHI_VPAGE) == va) {
+				tlb_write(TLBHI_INVALID(i),
+					  TLBLO_INVALID(), i);
+			}
+		}
+	}
+	splx(spl);
+}
+
+/*
+ * Invalidate every entry in this cpu's TLB.
+ */
+static
+void
+tlb_flush(void)
+{
+	int i, spl;
+
+	spl = splhigh();
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	curcpu->c_tlbnext = 0;
+	vmstats_inc(VMSTAT_TLB_INVALIDATE);
+	splx(spl);
+}
+
+void
+vm_tlbshootdown_all(void)
+{
+	/*
+	 * Only happens if more than TLBSHOOTDOWN_MAX requests pile
+	 * up, and their acknowledgements are lost with them;
+	 * tlb_shootdown_pages never has more than one batch
+	 * outstanding per cpu.
+	 */
+	tlb_flush();
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	/*
+	 * The owner's PID may have been replaced since its entry was
+	 * loaded here. The old entry is then dead anyway: the PID is
+	 * not handed out again before this cpu flushes its TLB.
+	 */
+	tlb_invalidate_page(ts->ts_addrspace, ts->ts_vaddr);
+	if (ts->ts_done != NULL) {
+		V(ts->ts_done);
+	}
+}
+
+#else
+
+void
+vm_tlbshootdown_all(void)
+{
+
+	panic("dumbvm tried to do tlb shootdown?!\n");
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	(void)ts;
+	panic("dumbvm tried to do tlb shootdown?!\n");
+}
+
+#endif /* OPT_A3 */
+
+#if OPT_A3
+
+/*
+ * Return the region of AS that contains user address VA, or NULL if
+ * VA is not part of the address space.
+ */
+static
+struct region *
+as_find_region(struct addrspace *as, vaddr_t va)
+{
+	struct region *rg;
+	unsigned i;
+
+	for (i=0; i<as->as_nregions; i++) {
+		rg = &as->as_regions[i];
+		if (va >= rg->rg_vbase &&
+		    va - rg->rg_vbase < rg->rg_npages * PAGE_SIZE) {
+			return rg;
+		}
+	}
+	rg = &as->as_stack;
+	if (va >= rg->rg_vbase &&
+	    va - rg->rg_vbase < rg->rg_npages * PAGE_SIZE) {
+		return rg;
+	}
+	rg = &as->as_heap;
+	if (va >= rg->rg_vbase &&
+	    va - rg->rg_vbase < rg->rg_npages * PAGE_SIZE) {
+		return rg;
+	}
+	for (i=0; i<as->as_nmaps; i++) {
+		rg = &as->as_maps[i];
+		if (va >= rg->rg_vbase &&
+		    va - rg->rg_vbase < rg->rg_npages * PAGE_SIZE) {
+			return rg;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Lowest address the stack of AS may grow down to.
+ */
+static
+vaddr_t
+as_stackfloor(struct addrspace *as)
+{
+	struct region *rg;
+	vaddr_t floor, top;
+	unsigned i;
+
+	if (as->as_stackmax >= USERSTACK / PAGE_SIZE) {
+		floor = 0;
+	}
+	else {
+		floor = USERSTACK - as->as_stackmax * PAGE_SIZE;
+	}
+	for (i=0; i<as->as_nregions; i++) {
+		rg = &as->as_regions[i];
+		top = rg->rg_vbase + (rg->rg_npages + VM_STACKGUARD) * PAGE_SIZE;
+		if (top > floor) {
+			floor = top;
+		}
+	}
+	rg = &as->as_heap;
+	top = rg->rg_vbase + (rg->rg_npages + VM_STACKGUARD) * PAGE_SIZE;
+	if (top > floor) {
+		floor = top;
+	}
+	for (i=0; i<as->as_nmaps; i++) {
+		rg = &as->as_maps[i];
+		top = rg->rg_vbase + (rg->rg_npages + VM_STACKGUARD) * PAGE_SIZE;
+		if (top > floor) {
+			floor = top;
+		}
+	}
+	return floor;
+}
+
+/*
+ * Lowest address the stack of AS may ever need: the bottom of its
+ * limit, or of the stack itself if that is already lower.
+ */
+static
+vaddr_t
+as_stackreserve(struct addrspace *as)
+{
+	vaddr_t limit;
+
+	limit = as->as_stack.rg_vbase;
+	if (as->as_stackmax < USERSTACK / PAGE_SIZE &&
+	    USERSTACK - as->as_stackmax * PAGE_SIZE < limit) {
+		limit = USERSTACK - as->as_stackmax * PAGE_SIZE;
+	}
+	return limit;
+}
+
+/*
+ * If VA is below the stack but within its room to grow, extend the
+ * stack region down to VA's page and return it. Otherwise return
+ * NULL. Pages skipped over are filled on demand like any others.
+ */
+static
+struct region *
+as_grow_stack(struct addrspace *as, vaddr_t va)
+{
+	struct region *rg = &as->as_stack;
+
+	va &= PAGE_FRAME;
+	if (rg->rg_npages == 0 || va >= rg->rg_vbase ||
+	    va < as_stackfloor(as)) {
+		return NULL;
+	}
+	rg->rg_npages += (rg->rg_vbase - va) / PAGE_SIZE;
+	rg->rg_vbase = va;
+	rg->rg_filevaddr = va;
+	return rg;
+}
+
+/*
+ * Get a frame for the page at PAGEVA in AS, part of region RG, and
+ * fill it: zero it, then read whatever part of it is backed by the
+ * executable. A page with no file bytes at all comes from the
+ * pre-zeroed pool if possible. Called from vm_fault the first time
+ * the page is touched; may sleep.
+ */
+static
+int
+load_page(struct addrspace *as, struct region *rg, vaddr_t pageva,
+	  paddr_t *ret)
+{
+	struct iovec iov;
+	struct uio u;
+	struct vnode *v;
+	vaddr_t start, end;
+	paddr_t paddr;
+	char *kva;
+	int result;
+
+	start = pageva > rg->rg_filevaddr ? pageva : rg->rg_filevaddr;
+	end = pageva + PAGE_SIZE;
+	if (end > rg->rg_filevaddr + rg->rg_filesz) {
+		end = rg->rg_filevaddr + rg->rg_filesz;
+	}
+
+	if (rg->rg_filesz == 0 || start >= end) {
+		paddr = coremap_alloc_zeroed(as);
+		if (paddr == 0) {
+			paddr = getppages(1, as);
+			if (paddr == 0) {
+				return ENOMEM;
+			}
+			bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+		}
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+		*ret = paddr;
+		return 0;
+	}
+
+	paddr = getppages(1, as);
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+	kva = (char *)PADDR_TO_KVADDR(paddr);
+	bzero(kva, PAGE_SIZE);
+
+	v = rg->rg_vnode != NULL ? rg->rg_vnode : as->as_vnode;
+	KASSERT(v != NULL);
+	uio_kinit(&iov, &u, kva + (start - pageva), end - start,
+		  rg->rg_offset + (start - rg->rg_filevaddr), UIO_READ);
+	result = VOP_READ(v, &u);
+	/* A mapped file may end mid-page, or mid-mapping. */
+	if (result == 0 && u.uio_resid != 0 && rg->rg_vnode == NULL) {
+		/* short read; the executable is truncated */
+		kprintf("dumbvm: short read on segment - file truncated?\n");
+		result = ENOEXEC;
+	}
+	if (result) {
+		coremap_free(paddr);
+		return result;
+	}
+	vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	if (rg->rg_vnode == NULL) {
+		vmstats_inc(VMSTAT_ELF_FILE_READ);
+	}
+	else {
+		vmstats_inc(VMSTAT_MAP_FILE_READ);
+	}
+	*ret = paddr;
+	return 0;
+}
+
+/*
+ * Like load_page, for a page of a read-only region backed by the
+ * executable: map the copy other processes running it already have,
+ * or read one in and share it with them.
+ */
+static
+int
+load_text_page(struct addrspace *as, struct region *rg, vaddr_t pageva,
+	       paddr_t *ret)
+{
+	paddr_t paddr;
+	int result;
+
+	paddr = textcache_lookup(as->as_vnode, pageva);
+	if (paddr == 0) {
+		result = load_page(as, rg, pageva, &paddr);
+		if (result) {
+			return result;
+		}
+		paddr = textcache_insert(as->as_vnode, pageva, paddr);
+	}
+	*ret = paddr;
+	return 0;
+}
+
+/*
+ * A write to the resident page at VA in AS, whose PTE is PTE, that
+ * the TLB entry did not allow. If the page belongs to a writeable
+ * shared mapping it was only write-protected so that the write would
+ * be noticed: enable writes, which marks it for writeback, and return
+ * true. Called with as_lock held.
+ */
+static
+bool
+shared_write(struct addrspace *as, vaddr_t va, pte_t *pte)
+{
+	struct region *rg;
+
+	if ((*pte & (PTE_SHARED | PTE_WRITE)) != PTE_SHARED) {
+		return false;
+	}
+	rg = as_find_region(as, va);
+	if (rg == NULL || !rg->rg_writeable) {
+		return false;
+	}
+	*pte |= PTE_WRITE;
+	return true;
+}
+
+/*
+ * Give AS a private, writeable copy of the copy-on-write page at VA,
+ * whose PTE is PTE. If every other sharer has already copied or gone
+ * away, the frame is simply taken over. Called with as_lock held;
+ * drops it while allocating, which is safe because shared frames are
+ * never evicted, so nothing else changes the PTE meanwhile.
+ */
+static
+int
+cow_break(struct addrspace *as, vaddr_t va, pte_t *pte)
+{
+	paddr_t oldpa, newpa;
+
+	KASSERT(lock_do_i_hold(as->as_lock));
+	KASSERT(*pte & PTE_VALID);
+	KASSERT(*pte & PTE_COW);
+
+	vmstats_inc(VMSTAT_COW_FAULT);
+	oldpa = *pte & PTE_FRAME;
+
+	if (coremap_refcount(oldpa) == 1) {
+		vmstats_inc(VMSTAT_COW_AVOIDED);
+	}
+	else {
+		lock_release(as->as_lock);
+		newpa = getppages(1, as);
+		lock_acquire(as->as_lock);
+		if (newpa == 0) {
+			return ENOMEM;
+		}
+		memmove((void *)PADDR_TO_KVADDR(newpa),
+			(const void *)PADDR_TO_KVADDR(oldpa),
+			PAGE_SIZE);
+		coremap_free(oldpa);
+		*pte = newpa | (*pte & ~PTE_FRAME);
+
+		/*
+		 * Another cpu this process ran on may still map VA to
+		 * the old frame, read-only, under our PID.
+		 */
+		tlb_shootdown_pages(as, &va, 1);
+	}
+	*pte = (*pte & ~PTE_COW) | PTE_WRITE;
+	coremap_map(*pte & PTE_FRAME, as, va);
+	return 0;
+}
+
+/*
+ * The part of tlb_insert below that does the work, without the
+ * statistics. Returns true if the entry went into a free slot. If
+ * there is none it goes over a random victim if REPLACE is set, and
+ * is not loaded at all otherwise.
+ */
+static
+bool
+tlb_load(struct addrspace *as, vaddr_t faultaddress, pte_t pte,
+	 bool replace)
+{
+	uint32_t ehi, elo, oldehi, oldelo;
+	unsigned i;
+	int spl;
+
+	ehi = faultaddress | as_pid(as);
+	elo = (pte & PTE_FRAME) | TLBLO_VALID;
+	if (pte & PTE_WRITE) {
+		elo |= TLBLO_DIRTY;
+	}
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", ehi, elo & TLBLO_PPAGE);
+	/*
+	 * The slots from c_tlbnext up were empty at the last flush, but
+	 * the refill handler's tlbwr may have filled any of them since;
+	 * pass over those. Each slot is looked at once per flush.
+	 */
+	while (curcpu->c_tlbnext < NUM_TLB) {
+		i = curcpu->c_tlbnext++;
+		tlb_read(&oldehi, &oldelo, i);
+		if ((oldelo & TLBLO_VALID) == 0) {
+			tlb_write(ehi, elo, i);
+			splx(spl);
+			return true;
+		}
+	}
+	if (replace) {
+		tlb_random(ehi, elo);
+	}
+	splx(spl);
+	return false;
+}
+
+/*
+ * Load the translation PTE for FAULTADDRESS in AS, the current
+ * address space, into the TLB: in a slot that has stayed empty since
+ * the last flush if there is one, and over a random victim otherwise.
+ * (Slots emptied by shootdowns are not tracked; tlb_random finds
+ * them often enough.) The caller knows FAULTADDRESS is not already
+ * in the TLB.
+ */
+static
+void
+tlb_insert(struct addrspace *as, vaddr_t faultaddress, pte_t pte)
+{
+	if (tlb_load(as, faultaddress, pte, true)) {
+		vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+	}
+	else {
+		vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+	}
+}
+
+/*
+ * Fault-around: after a miss at FAULTADDRESS in AS, load the
+ * translations of the resident pages among the next vm_faultaround
+ * pages of the same region that are not in the TLB already, so that
+ * a sequential scan misses once per stretch instead of once per page.
+ * They count as referenced, as the clock cannot see their use while
+ * they are in the TLB. They only go into free slots, so that they
+ * never push out the entry just loaded for FAULTADDRESS, or anything
+ * else in use. Called with as_lock held.
+ */
+static
+void
+tlb_faultaround(struct addrspace *as, vaddr_t faultaddress)
+{
+	struct region *rg;
+	vaddr_t va, end;
+	unsigned n;
+	pte_t *pte;
+	int i, spl;
+
+	if (vm_faultaround == 0) {
+		return;
+	}
+	rg = as_find_region(as, faultaddress);
+	if (rg == NULL) {
+		return;
+	}
+	end = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+
+	va = (faultaddress & PAGE_FRAME) + PAGE_SIZE;
+	for (n = 0; n < vm_faultaround && va < end; n++, va += PAGE_SIZE) {
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte == NULL || !(*pte & PTE_VALID)) {
+			continue;
+		}
+		spl = splhigh();
+		i = tlb_probe(va | as_pid(as), 0);
+		if (i >= 0) {
+			splx(spl);
+			continue;
+		}
+		if (!tlb_load(as, va, *pte, false)) {
+			/* No free slots left. */
+			splx(spl);
+			break;
+		}
+		curcpu->c_faloads++;
+		splx(spl);
+		coremap_touch(*pte & PTE_FRAME);
+	}
+}
+
+/*
+ * Rewrite the TLB entry for FAULTADDRESS, if there still is one,
+ * after its PTE changed. If it has gone the next access simply
+ * misses and reloads.
+ */
+static
+void
+tlb_update(struct addrspace *as, vaddr_t faultaddress, pte_t pte)
+{
+	uint32_t ehi, elo;
+	int i, spl;
+
+	ehi = faultaddress | as_pid(as);
+	elo = (pte & PTE_FRAME) | TLBLO_VALID;
+	if (pte & PTE_WRITE) {
+		elo |= TLBLO_DIRTY;
+	}
+
+	spl = splhigh();
+	i = tlb_probe(ehi, 0);
+	if (i >= 0) {
+		tlb_write(ehi, elo, i);
+	}
+	splx(spl);
+}
+
+/*
+ * Make sure no cpu still has a TLB entry for any of the NVAS pages
+ * at VAS in AS (NULL if they belong to various address spaces), and
+ * wait until that is so.
+ *
+ * The pages go to each other cpu as one batch, in one IPI, and only
+ * the last entry of the batch carries the acknowledgement. Only cpus
+ * that have run AS under its current PID are asked (see as_cpus);
+ * with AS NULL, every cpu is. Senders take shootdown_lock and wait
+ * for every acknowledgement, so at most one batch is ever queued per
+ * cpu and, since a batch fits in TLBSHOOTDOWN_MAX, none of them can
+ * be lost to a TLBSHOOTDOWN_ALL.
+ */
+static
+void
+tlb_shootdown_pages(struct addrspace *as, const vaddr_t *vas, unsigned nvas)
+{
+	struct tlbshootdown ts[TLBSHOOTDOWN_MAX];
+	struct cpu *c;
+	uint32_t targets;
+	unsigned i, j, n, sent;
+	bool others;
+	int spl;
+
+	KASSERT(nvas > 0);
+	KASSERT(nvas <= TLBSHOOTDOWN_MAX);
+
+	for (j=0; j<nvas; j++) {
+		ts[j].ts_addrspace = as;
+		ts[j].ts_vaddr = vas[j];
+		ts[j].ts_done = NULL;
+	}
+	ts[nvas-1].ts_done = shootdown_sem;
+
+	/*
+	 * Without other cpus to ask there is no need to sleep for the
+	 * lock. A cpu that starts using the PID after this check loads
+	 * its entries from the PTEs as they are now. Interrupts stay
+	 * off until the local entries are gone, so that we cannot be
+	 * moved to another cpu in between and leave them behind.
+	 */
+	n = cpu_count();
+	spl = splhigh();
+	targets = as != NULL ? as_cpus(as) : ~(uint32_t)0;
+	others = (targets & ~((uint32_t)1 << curcpu->c_number)) != 0;
+	if (n == 1 || !others || shootdown_lock == NULL) {
+		for (j=0; j<nvas; j++) {
+			tlb_invalidate_page(as, vas[j]);
+		}
+		splx(spl);
+		return;
+	}
+	splx(spl);
+
+	lock_acquire(shootdown_lock);
+
+	/* Stay on this cpu until every other one has been asked. */
+	spl = splhigh();
+	targets = as != NULL ? as_cpus(as) : ~(uint32_t)0;
+	for (j=0; j<nvas; j++) {
+		tlb_invalidate_page(as, vas[j]);
+	}
+	sent = 0;
+	for (i=0; i<n; i++) {
+		c = cpu_get(i);
+		if (c == curcpu || !(targets & ((uint32_t)1 << c->c_number))) {
+			continue;
+		}
+		ipi_tlbshootdown_batch(c, ts, nvas);
+		sent++;
+		vmstats_inc(VMSTAT_SHOOTDOWN_IPI);
+		for (j=0; j<nvas; j++) {
+			vmstats_inc(VMSTAT_SHOOTDOWN_PAGE);
+		}
+	}
+	splx(spl);
+
+	while (sent > 0) {
+		P(shootdown_sem);
+		sent--;
+	}
+
+	lock_release(shootdown_lock);
+}
+
+/*
+ * Write the page at VA in OWNER, held in frame PADDR, out to a swap
+ * slot and point its PTE there. Called with OWNER's as_lock and
+ * PADDR pinned. The PTE changes before the shootdown and the copy is
+ * made after it, so no store through a stale translation can slip in
+ * after the copy.
+ */
+static
+int
+vm_pageout(struct addrspace *owner, vaddr_t va, paddr_t paddr)
+{
+	pte_t *pte, oldpte;
+	unsigned slot;
+	int result;
+
+	pte = pt_lookup(owner->as_pt, va, false);
+	KASSERT(pte != NULL);
+	KASSERT((*pte & (PTE_VALID | PTE_COW)) == PTE_VALID);
+	KASSERT((*pte & PTE_FRAME) == paddr);
+
+	result = swap_alloc(&slot);
+	if (result) {
+		return result;
+	}
+
+	oldpte = *pte;
+	*pte = PTE_FROMSLOT(slot) | PTE_SWAPPED | (oldpte & PTE_WRITE);
+	tlb_shootdown_pages(owner, &va, 1);
+
+	result = swap_out(slot, paddr);
+	if (result) {
+		*pte = oldpte;
+		swap_free(slot);
+		return result;
+	}
+	vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+	return 0;
+}
+
+/*
+ * True if the current thread may sleep, and so may page things out.
+ */
+static
+bool
+vm_can_evict(void)
+{
+	return evict_lock != NULL &&
+		!curthread->t_in_interrupt &&
+		curthread->t_curspl == 0 &&
+		!lock_do_i_hold(evict_lock);
+}
+
+/*
+ * Free one frame by pushing a private user page out to swap. Returns
+ * 0 on success, or an error if nothing could be evicted. The coremap
+ * picks the victim according to the current replacement policy.
+ *
+ * The victim's address space must be locked so that its owner does
+ * not fault on, copy, or destroy the page while it is in flight. The
+ * owner may itself be waiting here for evict_lock, so we only try
+ * for its lock and move on to another victim if it is busy. Between
+ * pinning a frame and getting that lock interrupts stay off, since
+ * anyone freeing the frame waits for the pin to go.
+ */
+static
+int
+vm_evict(void)
+{
+	struct addrspace *owner;
+	struct cm_sweep sweep;
+	vaddr_t va;
+	paddr_t pa;
+	bool locked, busy;
+	unsigned n, nsweeps;
+	int result, spl;
+
+	lock_acquire(evict_lock);
+
+	result = ENOMEM;
+	n = nsweeps = 0;
+	while (n < VM_EVICT_CANDIDATES) {
+		locked = busy = false;
+		spl = splhigh();
+		sweep.cs_count = 0;
+		pa = coremap_pin_victim(&owner, &va,
+				nsweeps < VM_EVICT_SWEEPS ? &sweep : NULL);
+		if (pa != 0) {
+			if (lock_tryacquire(owner->as_lock)) {
+				locked = true;
+			}
+			else if (!lock_do_i_hold(owner->as_lock)) {
+				/* Busy; try someone else. */
+				coremap_unpin(pa);
+				pa = 0;
+				busy = true;
+				n++;
+			}
+		}
+		splx(spl);
+
+		/*
+		 * Pages the clock passed over lost their reference bits;
+		 * drop their translations so the next touch faults and
+		 * sets the bit again.
+		 */
+		if (sweep.cs_count > 0) {
+			tlb_shootdown_pages(NULL, sweep.cs_vaddr,
+					    sweep.cs_count);
+			nsweeps++;
+		}
+		if (pa == 0) {
+			if (sweep.cs_count == 0 && !busy) {
+				/* Nothing evictable just now. */
+				break;
+			}
+			continue;
+		}
+		n++;
+
+		result = vm_pageout(owner, va, pa);
+		coremap_unpin(pa);
+		if (result == 0) {
+			coremap_free(pa);
+			coremap_count(CM_COUNT_EVICT);
+		}
+		if (locked) {
+			lock_release(owner->as_lock);
+		}
+		if (result == 0 || result == ENOSPC) {
+			break;
+		}
+	}
+
+	lock_release(evict_lock);
+	return result;
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	struct region *rg;
+	pte_t *pte;
+	paddr_t paddr;
+	int result;
+
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = curproc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	if (faultaddress >= USERSPACETOP) {
+		return EFAULT;
+	}
+
+	/*
+	 * as_lock keeps the pageout code away from our resident pages
+	 * while we look at them. It is dropped around allocation and
+	 * disk I/O; the PTEs involved then are not resident, so only
+	 * this thread changes them.
+	 */
+	lock_acquire(as->as_lock);
+	pte = pt_lookup(as->as_pt, faultaddress, false);
+
+	/*
+	 * Write through a TLB entry without the dirty bit: fine only
+	 * if the page is copy-on-write rather than truly read-only.
+	 */
+	if (faulttype == VM_FAULT_READONLY) {
+		if (pte == NULL || !(*pte & PTE_VALID)) {
+			/* Evicted since; the retry will miss and reload. */
+			result = 0;
+		}
+		else if (*pte & PTE_COW) {
+			result = cow_break(as, faultaddress, pte);
+			if (result == 0) {
+				tlb_update(as, faultaddress, *pte);
+			}
+		}
+		else if (shared_write(as, faultaddress, pte)) {
+			tlb_update(as, faultaddress, *pte);
+			result = 0;
+		}
+		else {
+			result = EFAULT;
+		}
+		lock_release(as->as_lock);
+		return result;
+	}
+
+	/* Resident page that simply fell out of the TLB. */
+	if (pte != NULL && (*pte & PTE_VALID)) {
+		if (faulttype == VM_FAULT_WRITE && (*pte & PTE_COW)) {
+			/* Copy now rather than take a second fault. */
+			result = cow_break(as, faultaddress, pte);
+			if (result) {
+				lock_release(as->as_lock);
+				return result;
+			}
+		}
+		if (faulttype == VM_FAULT_WRITE) {
+			/* Likewise note the write now. */
+			shared_write(as, faultaddress, pte);
+		}
+		vmstats_inc(VMSTAT_TLB_FAULT);
+		vmstats_inc(VMSTAT_TLB_RELOAD);
+		coremap_touch(*pte & PTE_FRAME);
+		tlb_insert(as, faultaddress, *pte);
+		tlb_faultaround(as, faultaddress);
+		lock_release(as->as_lock);
+		return 0;
+	}
+
+	/* Paged out: read it back from its swap slot. */
+	if (pte != NULL && (*pte & PTE_SWAPPED)) {
+		lock_release(as->as_lock);
+		paddr = getppages(1, as);
+		if (paddr == 0) {
+			return ENOMEM;
+		}
+		result = swap_in(PTE_TOSLOT(*pte), paddr);
+		if (result) {
+			coremap_free(paddr);
+			return result;
+		}
+		lock_acquire(as->as_lock);
+		swap_free(PTE_TOSLOT(*pte));
+		*pte = paddr | PTE_VALID | (*pte & PTE_WRITE);
+		coremap_map(paddr, as, faultaddress);
+
+		vmstats_inc(VMSTAT_TLB_FAULT);
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+		vmstats_inc(VMSTAT_SWAP_FILE_READ);
+		coremap_count(CM_COUNT_FAULT);
+		coremap_count(CM_COUNT_SWAPIN);
+		tlb_insert(as, faultaddress, *pte);
+		tlb_faultaround(as, faultaddress);
+		lock_release(as->as_lock);
+		return 0;
+	}
+	lock_release(as->as_lock);
+
+	rg = as_find_region(as, faultaddress);
+	if (rg == NULL) {
+		rg = as_grow_stack(as, faultaddress);
+		if (rg == NULL) {
+			return EFAULT;
+		}
+	}
+
+	/* First touch: bring the page in before mapping it. */
+	pte = pt_lookup(as->as_pt, faultaddress, true);
+	if (pte == NULL) {
+		return ENOMEM;
+	}
+	if (!rg->rg_writeable && rg->rg_filesz > 0 && rg->rg_vnode == NULL) {
+		result = load_text_page(as, rg, faultaddress, &paddr);
+		if (result) {
+			return result;
+		}
+		lock_acquire(as->as_lock);
+		*pte = paddr | PTE_VALID | PTE_TEXT;
+	}
+	else if (rg->rg_shared) {
+		result = load_page(as, rg, faultaddress, &paddr);
+		if (result) {
+			return result;
+		}
+		lock_acquire(as->as_lock);
+		*pte = paddr | PTE_VALID | PTE_SHARED;
+		if (rg->rg_writeable && faulttype == VM_FAULT_WRITE) {
+			*pte |= PTE_WRITE;
+		}
+	}
+	else {
+		result = load_page(as, rg, faultaddress, &paddr);
+		if (result) {
+			return result;
+		}
+		lock_acquire(as->as_lock);
+		*pte = paddr | PTE_VALID | (rg->rg_writeable ? PTE_WRITE : 0);
+		coremap_map(paddr, as, faultaddress);
+	}
+
+	vmstats_inc(VMSTAT_TLB_FAULT);
+	coremap_count(CM_COUNT_FAULT);
+	tlb_insert(as, faultaddress, *pte);
+	tlb_faultaround(as, faultaddress);
+	lock_release(as->as_lock);
+	return 0;
+}
+
+/*
+ * Constructor and destructor for as_cache.
+ */
+static
+int
+as_ctor(void *obj)
+{
+	struct addrspace *as = obj;
+
+	as->as_lock = lock_create("addrspace");
+	if (as->as_lock == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+as_dtor(void *obj)
+{
+	struct addrspace *as = obj;
+
+	lock_destroy(as->as_lock);
+}
+
+struct addrspace *
+as_create(void)
+{
+	struct addrspace *as = kmem_cache_alloc(as_cache);
+	if (as==NULL) {
+		return NULL;
+	}
+
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		kmem_cache_free(as_cache, as);
+		return NULL;
+	}
+	as->as_nregions = 0;
+	bzero(&as->as_stack, sizeof(as->as_stack));
+	bzero(&as->as_heap, sizeof(as->as_heap));
+	as->as_brk = 0;
+	as->as_nmaps = 0;
+	as->as_vnode = NULL;
+	as->as_asid = 0;
+	as->as_asidgen = 0;
+	as->as_cpus = 0;
+	as->as_stackmax = vm_stacklimit;
+
+	return as;
+}
+
+/*
+ * pt_walk callback: release the frame behind one PTE of the address
+ * space DATA.
+ */
+static
+int
+as_freepage(vaddr_t va, pte_t *pte, void *data)
+{
+	struct addrspace *as = data;
+
+	if (*pte & PTE_COW) {
+		/* Dropped while still shared: a copy never made. */
+		vmstats_inc(VMSTAT_COW_AVOIDED);
+	}
+	if (*pte & PTE_TEXT) {
+		textcache_release(as->as_vnode, va, *pte & PTE_FRAME);
+	}
+	else if (*pte & PTE_VALID) {
+		coremap_free(*pte & PTE_FRAME);
+	}
+	else if (*pte & PTE_SWAPPED) {
+		swap_free(PTE_TOSLOT(*pte));
+	}
+	*pte = 0;
+	return 0;
+}
+
+/*
+ * Release the NVAS pages at VAS in AS, which must have PTEs, once no
+ * TLB maps them any more. Called with as_lock held.
+ */
+static
+void
+as_freepages(struct addrspace *as, const vaddr_t *vas, unsigned nvas)
+{
+	pte_t *pte;
+	unsigned i;
+
+	tlb_shootdown_pages(as, vas, nvas);
+	for (i=0; i<nvas; i++) {
+		pte = pt_lookup(as->as_pt, vas[i], false);
+		KASSERT(pte != NULL);
+		as_freepage(vas[i], pte, as);
+	}
+}
+
+/*
+ * Release the pages of AS in [START, END), a batch of shootdowns at
+ * a time. Called with as_lock held.
+ */
+static
+void
+as_freerange(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	vaddr_t vas[TLBSHOOTDOWN_MAX];
+	vaddr_t va;
+	unsigned n;
+	pte_t *pte;
+
+	n = 0;
+	for (va = start; va < end; va += PAGE_SIZE) {
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte == NULL || *pte == 0) {
+			continue;
+		}
+		vas[n++] = va;
+		if (n == TLBSHOOTDOWN_MAX) {
+			as_freepages(as, vas, n);
+			n = 0;
+		}
+	}
+	if (n > 0) {
+		as_freepages(as, vas, n);
+	}
+}
+
+/*
+ * Write back the pages of [START, END) in shared file mapping RG of
+ * AS that have been written since they were last written back, and
+ * write-protect them again so that the next write is noticed. Pages
+ * past the end of the file are not written; mappings never extend
+ * files. Called with as_lock held.
+ */
+static
+int
+as_writeback(struct addrspace *as, struct region *rg,
+	     vaddr_t start, vaddr_t end)
+{
+	struct iovec iov;
+	struct uio u;
+	struct stat st;
+	vaddr_t vas[TLBSHOOTDOWN_MAX];
+	vaddr_t va;
+	off_t offset;
+	size_t len;
+	pte_t *pte;
+	unsigned i, n;
+	int result;
+
+	if (rg->rg_vnode == NULL || !rg->rg_shared) {
+		return 0;
+	}
+	result = VOP_STAT(rg->rg_vnode, &st);
+	if (result) {
+		return result;
+	}
+
+	va = start;
+	while (va < end) {
+		/*
+		 * Write-protect a batch of dirty pages, and take write
+		 * access out of every TLB before copying them, so that
+		 * no store can slip in after the copy.
+		 */
+		n = 0;
+		for (; va < end && n < TLBSHOOTDOWN_MAX; va += PAGE_SIZE) {
+			pte = pt_lookup(as->as_pt, va, false);
+			if (pte == NULL ||
+			    (*pte & (PTE_VALID | PTE_WRITE)) !=
+			    (PTE_VALID | PTE_WRITE)) {
+				continue;
+			}
+			offset = rg->rg_offset + (va - rg->rg_vbase);
+			if (offset >= st.st_size) {
+				continue;
+			}
+			*pte &= ~PTE_WRITE;
+			vas[n++] = va;
+		}
+		if (n == 0) {
+			break;
+		}
+		tlb_shootdown_pages(as, vas, n);
+
+		for (i=0; i<n; i++) {
+			pte = pt_lookup(as->as_pt, vas[i], false);
+			offset = rg->rg_offset + (vas[i] - rg->rg_vbase);
+			len = PAGE_SIZE;
+			if (st.st_size - offset < PAGE_SIZE) {
+				len = st.st_size - offset;
+			}
+			uio_kinit(&iov, &u,
+				  (void *)PADDR_TO_KVADDR(*pte & PTE_FRAME),
+				  len, offset, UIO_WRITE);
+			result = VOP_WRITE(rg->rg_vnode, &u);
+			if (result) {
+				/* These are still dirty. */
+				for (; i<n; i++) {
+					pte = pt_lookup(as->as_pt, vas[i],
+							false);
+					*pte |= PTE_WRITE;
+				}
+				return result;
+			}
+		}
+	}
+	return 0;
+}
+
+void
+as_destroy(struct addrspace *as)
+{
+	struct region *rg;
+	struct cpu *c;
+	unsigned i, n;
+	int spl;
+
+	/* Wait out any page-out in progress, and keep new ones away. */
+	lock_acquire(as->as_lock);
+	for (i=0; i<as->as_nmaps; i++) {
+		rg = &as->as_maps[i];
+		/* Nobody is left to hear about a failure. */
+		as_writeback(as, rg, rg->rg_vbase,
+			     rg->rg_vbase + rg->rg_npages * PAGE_SIZE);
+	}
+
+	/*
+	 * Keep the refill handlers out of the table before it goes.
+	 * Any cpu AS ran on may still point at it, since switching to
+	 * a thread with no address space leaves the pointer alone.
+	 * (Not before the writeback, which may sleep, and coming back
+	 * reactivates AS.)
+	 */
+	spl = splhigh();
+	n = cpu_count();
+	for (i=0; i<n; i++) {
+		c = cpu_get(i);
+		if (cpupagetables[c->c_number] ==
+		    (vaddr_t)as->as_pt->pt_dir) {
+			cpupagetables[c->c_number] = 0;
+		}
+	}
+	splx(spl);
+
+	pt_walk(as->as_pt, as_freepage, as);
+	lock_release(as->as_lock);
+
+	for (i=0; i<as->as_nmaps; i++) {
+		if (as->as_maps[i].rg_vnode != NULL) {
+			VOP_DECREF(as->as_maps[i].rg_vnode);
+		}
+	}
+	pt_destroy(as->as_pt);
+	if (as->as_vnode != NULL) {
+		VOP_DECREF(as->as_vnode);
+	}
+	kmem_cache_free(as_cache, as);
+}
+
+int
+as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+		 int readable, int writeable, int executable)
+{
+	struct region *rg;
+	size_t npages; 
+
+	/* Align the region. First, the base... */
+	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	npages = sz / PAGE_SIZE;
+
+	/*
+	 * Segments are no longer copied in with uiomove, which used to
+	 * catch this; check it here instead.
+	 */
+	if (vaddr >= USERSPACETOP || sz > USERSPACETOP - vaddr) {
+		return EFAULT;
+	}
+
+	/* Only write permission is enforced. */
+	(void)readable;
+	(void)executable;
+
+	if (as->as_nregions == AS_MAXREGIONS) {
+		kprintf("dumbvm: Warning: too many regions\n");
+		return EUNIMP;
+	}
+
+	rg = &as->as_regions[as->as_nregions++];
+	rg->rg_vbase = vaddr;
+	rg->rg_npages = npages;
+	rg->rg_writeable = writeable != 0;
+	rg->rg_filevaddr = vaddr;
+	rg->rg_offset = 0;
+	rg->rg_filesz = 0;
+	rg->rg_vnode = NULL;
+	rg->rg_shared = false;
+	return 0;
+}
+
+int
+as_prepare_load(struct addrspace *as)
+{
+	/* Nothing to allocate; vm_fault fills pages as they are used. */
+	(void)as;
+	return 0;
+}
+
+int
+as_map_segment(struct addrspace *as, struct vnode *v,
+	       off_t offset, vaddr_t vaddr, size_t filesz)
+{
+	struct region *rg;
+
+	rg = as_find_region(as, vaddr);
+	if (rg == NULL || rg->rg_vbase != (vaddr & PAGE_FRAME)) {
+		return ENOEXEC;
+	}
+
+	if (as->as_vnode == NULL) {
+		VOP_INCREF(v);
+		as->as_vnode = v;
+	}
+	KASSERT(as->as_vnode == v);
+
+	rg->rg_filevaddr = vaddr;
+	rg->rg_offset = offset;
+	rg->rg_filesz = filesz;
+	return 0;
+}
+
+int
+as_complete_load(struct addrspace *as)
+{
+	struct region *rg = &as->as_heap;
+	vaddr_t top;
+	unsigned i;
+
+	/* The heap starts empty, on the page above the highest segment. */
+	rg->rg_vbase = 0;
+	for (i=0; i<as->as_nregions; i++) {
+		top = as->as_regions[i].rg_vbase +
+			as->as_regions[i].rg_npages * PAGE_SIZE;
+		if (top > rg->rg_vbase) {
+			rg->rg_vbase = top;
+		}
+	}
+	rg->rg_npages = 0;
+	rg->rg_writeable = true;
+	rg->rg_filevaddr = rg->rg_vbase;
+	rg->rg_offset = 0;
+	rg->rg_filesz = 0;
+	rg->rg_vnode = NULL;
+	rg->rg_shared = false;
+	as->as_brk = rg->rg_vbase;
+	return 0;
+}
 
-/*
- * Dumb MIPS-only "VM system" that is intended to only be just barely
- * enough to struggle off the ground.
- */
+int
+as_define_stack(struct addrspace *as, vaddr_t *stackptr)
+{
+	struct region *rg = &as->as_stack;
+
+	/* One page to start with; vm_fault grows it. */
+	rg->rg_vbase = USERSTACK - PAGE_SIZE;
+	rg->rg_npages = 1;
+	rg->rg_writeable = true;
+	rg->rg_filevaddr = rg->rg_vbase;
+	rg->rg_offset = 0;
+	rg->rg_filesz = 0;
+	rg->rg_vnode = NULL;
+	rg->rg_shared = false;
 
-/* under dumbvm, always have 48k of user stack */
-#define DUMBVM_STACKPAGES    12
+	*stackptr = USERSTACK;
+	return 0;
+}
 
-static volatile bool checkbit = false;
+/* What as_copy's pt_walk carries along. */
+struct as_copyargs {
+	struct addrspace *ca_old;
+	struct addrspace *ca_new;
+	vaddr_t ca_vas[TLBSHOOTDOWN_MAX];  /* pages OLD can no longer write */
+	unsigned ca_nvas;
+};
 
 /*
- * Wrap rma_stealmem in a spinlock.
+ * pt_walk callback: share one resident page of the parent with the
+ * child, as described by the as_copyargs DATA. Writeable pages become
+ * copy-on-write on both sides, and their write access is shot down
+ * in batches. A page that is out in swap is read into a frame of the
+ * child's own.
  */
-static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
-
-#if OPT_A3
-//Keep track of the status of each frame (core-map data structure).
-struct coremap *core_map;
-int numofframes;
+static
+int
+as_sharepage(vaddr_t va, pte_t *pte, void *data)
+{
+	struct as_copyargs *ca = data;
+	struct addrspace *new = ca->ca_new;
+	pte_t *newpte;
+	paddr_t paddr;
+	int result;
 
-struct coremap *newcoremap (){
+	newpte = pt_lookup(new->as_pt, va, true);
+	if (newpte == NULL) {
+		return ENOMEM;
+	}
 
-	struct coremap *result;
-	KASSERT(result!=NULL);
+	if (*pte & PTE_SWAPPED) {
+		/* Slots are not shared; the child gets its own frame. */
+		paddr = getppages(1, new);
+		if (paddr == 0) {
+			return ENOMEM;
+		}
+		result = swap_in(PTE_TOSLOT(*pte), paddr);
+		if (result) {
+			coremap_free(paddr);
+			return result;
+		}
+		*newpte = paddr | PTE_VALID | (*pte & PTE_WRITE);
+		coremap_map(paddr, new, va);
+		return 0;
+	}
 
-	paddr_t begin =0;
-	paddr_t end =0;
-	paddr_t startusebit =0;
+	KASSERT(*pte & PTE_VALID);
+	coremap_share(*pte & PTE_FRAME);
+	if (*pte & PTE_SHARED) {
+		/* Stays shared; the child notices its own writes. */
+		*newpte = *pte & ~PTE_WRITE;
+		return 0;
+	}
+	if (*pte & PTE_WRITE) {
+		*pte = (*pte & ~PTE_WRITE) | PTE_COW;
+		ca->ca_vas[ca->ca_nvas++] = va;
+		if (ca->ca_nvas == TLBSHOOTDOWN_MAX) {
+			tlb_shootdown_pages(ca->ca_old, ca->ca_vas,
+					    ca->ca_nvas);
+			ca->ca_nvas = 0;
+		}
+	}
+	*newpte = *pte;
+	return 0;
+}
 
-	ram_getsize ( &begin, &end);
+int
+as_copy(struct addrspace *old, struct addrspace **ret)
+{
+	struct as_copyargs ca;
+	struct addrspace *new;
+	unsigned i;
+	int result;
 
-	result = (struct coremap*) PADDR_TO_KVADDR(begin);
+	new = as_create();
+	if (new==NULL) {
+		return ENOMEM;
+	}
 
-	begin += begin + sizeof(struct coremap);
-	begin = ROUNDUP(begin, PAGE_SIZE);
-	numofframes = (end - begin)/PAGE_SIZE;
-	startusebit = begin;
+	memcpy(new->as_regions, old->as_regions, sizeof(old->as_regions));
+	new->as_nregions = old->as_nregions;
+	new->as_stack = old->as_stack;
+	new->as_heap = old->as_heap;
+	new->as_brk = old->as_brk;
+	for (i=0; i<old->as_nmaps; i++) {
+		new->as_maps[i] = old->as_maps[i];
+		if (new->as_maps[i].rg_vnode != NULL) {
+			VOP_INCREF(new->as_maps[i].rg_vnode);
+		}
+	}
+	new->as_nmaps = old->as_nmaps;
+	new->as_stackmax = old->as_stackmax;
+	if (old->as_vnode != NULL) {
+		VOP_INCREF(old->as_vnode);
+		new->as_vnode = old->as_vnode;
+	}
 
-	for (int i=0; i<numofframes;i++){
-		result[i].paddr=startusebit;
-		result[i].csize=0;
-		startusebit+=PAGE_SIZE;
+	/*
+	 * Share the resident pages; the rest load on demand in the
+	 * child. OLD may have just lost write permission on pages that
+	 * are still in some TLB; the last of them are shot down here,
+	 * even if the walk stopped part way.
+	 */
+	ca.ca_old = old;
+	ca.ca_new = new;
+	ca.ca_nvas = 0;
+	lock_acquire(old->as_lock);
+	lock_acquire(new->as_lock);
+	result = pt_walk(old->as_pt, as_sharepage, &ca);
+	if (ca.ca_nvas > 0) {
+		tlb_shootdown_pages(old, ca.ca_vas, ca.ca_nvas);
+	}
+	lock_release(new->as_lock);
+	lock_release(old->as_lock);
+	if (result) {
+		as_destroy(new);
+		return result;
 	}
 
-	return result;
+	*ret = new;
+	return 0;
 }
 
-#endif // OPT_A3
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbrk)
+{
+	struct region *rg = &as->as_heap;
+	vaddr_t newbrk, limit;
+	size_t npages;
+	unsigned i;
 
+	if (amount >= 0) {
+		/*
+		 * The heap must leave room for the stack at its limit,
+		 * and stay clear of mmap regions.
+		 */
+		limit = as_stackreserve(as);
+		for (i=0; i<as->as_nmaps; i++) {
+			if (as->as_maps[i].rg_vbase < limit) {
+				limit = as->as_maps[i].rg_vbase;
+			}
+		}
+		if (limit < VM_STACKGUARD * PAGE_SIZE) {
+			return ENOMEM;
+		}
+		limit -= VM_STACKGUARD * PAGE_SIZE;
+		if ((vaddr_t)amount > limit || as->as_brk > limit - amount) {
+			return ENOMEM;
+		}
+	}
+	else if ((vaddr_t)-amount > as->as_brk - rg->rg_vbase) {
+		return EINVAL;
+	}
+	newbrk = as->as_brk + amount;
+	npages = DIVROUNDUP(newbrk - rg->rg_vbase, PAGE_SIZE);
 
-void
-vm_bootstrap(void)
-{
-	core_map = newcoremap();
-//	afterinit();
-	checkbit = true;
+	if (npages < rg->rg_npages) {
+		/*
+		 * Give back the pages above the new break. If the heap
+		 * grows over them again they fault in as fresh zeroes.
+		 */
+		lock_acquire(as->as_lock);
+		as_freerange(as, rg->rg_vbase + npages * PAGE_SIZE,
+			     rg->rg_vbase + rg->rg_npages * PAGE_SIZE);
+		lock_release(as->as_lock);
+	}
+	rg->rg_npages = npages;
 
+	*oldbrk = as->as_brk;
+	as->as_brk = newbrk;
+	return 0;
 }
 
-static
-paddr_t
-getppages(unsigned long npages)
+int
+as_mmap(struct addrspace *as, size_t len, int prot, int flags,
+	struct vnode *v, off_t offset, vaddr_t *ret)
 {
-	paddr_t addr = 0;
+	struct region *rg;
+	vaddr_t top, bottom, size;
+	unsigned i;
 
-	spinlock_acquire(&stealmem_lock);
+	if (len == 0 || offset < 0 || (offset & ~(off_t)PAGE_FRAME) != 0) {
+		return EINVAL;
+	}
+	/*
+	 * Regions are always readable, so PROT_NONE cannot be honoured;
+	 * refuse it rather than hand back a readable guard mapping.
+	 */
+	if ((prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0 ||
+	    prot == PROT_NONE ||
+	    (flags & ~(MAP_SHARED | MAP_PRIVATE | MAP_ANON)) != 0) {
+		return EINVAL;
+	}
+	if (len > USERSPACETOP || as->as_nmaps == AS_MAXMAPS) {
+		return ENOMEM;
+	}
+	size = ROUNDUP(len, PAGE_SIZE);
 
+	/*
+	 * Take the highest gap that fits between the heap and the
+	 * stack's reach, keeping VM_STACKGUARD pages from each.
+	 */
+	rg = &as->as_heap;
+	bottom = rg->rg_vbase + (rg->rg_npages + VM_STACKGUARD) * PAGE_SIZE;
+	top = as_stackreserve(as);
+	if (top < VM_STACKGUARD * PAGE_SIZE) {
+		return ENOMEM;
+	}
+	top -= VM_STACKGUARD * PAGE_SIZE;
+ again:
+	if (top < bottom || top - bottom < size) {
+		return ENOMEM;
+	}
+	for (i=0; i<as->as_nmaps; i++) {
+		rg = &as->as_maps[i];
+		if (rg->rg_vbase < top &&
+		    top - size < rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+			top = rg->rg_vbase;
+			goto again;
+		}
+	}
 
-	if(!checkbit){
-		addr = ram_stealmem(npages);
-		spinlock_release(&stealmem_lock);
-		return addr;
+	rg = &as->as_maps[as->as_nmaps++];
+	rg->rg_vbase = top - size;
+	rg->rg_npages = size / PAGE_SIZE;
+	rg->rg_writeable = (prot & PROT_WRITE) != 0;
+	rg->rg_filevaddr = rg->rg_vbase;
+	rg->rg_offset = offset;
+	rg->rg_filesz = v != NULL ? size : 0;
+	rg->rg_vnode = v;
+	rg->rg_shared = (flags & MAP_SHARED) != 0;
+	if (v != NULL) {
+		VOP_INCREF(v);
 	}
 
-	#if OPT_A3
-	int temp_npages = (int) npages;
-	int continuebit = 0;
-	int firstbit = -1;
+	*ret = rg->rg_vbase;
+	return 0;
+}
 
-	//check is npages contiguously available
-	for(int i = 0; i < numofframes; i++){
-		if (core_map[i].csize == 0){
-			if (firstbit < 0){
-				firstbit = i;
-			}
-			continuebit++;
-			if (continuebit == temp_npages){
-				break;
-			}
-		} else {
-			continuebit = 0;
-			firstbit = -1;
+int
+as_munmap(struct addrspace *as, vaddr_t addr, size_t len)
+{
+	struct region *rg = NULL;
+	struct vnode *v;
+	unsigned i;
+	int result;
+
+	for (i=0; i<as->as_nmaps; i++) {
+		if (as->as_maps[i].rg_vbase == addr) {
+			rg = &as->as_maps[i];
+			break;
 		}
 	}
+	if (rg == NULL || len == 0 ||
+	    DIVROUNDUP(len, PAGE_SIZE) != rg->rg_npages) {
+		return EINVAL;
+	}
 
-	if (continuebit == temp_npages){
-		addr = core_map[firstbit].paddr;
-		for (int i = 0; i < temp_npages; ++i){
-			core_map[firstbit + i].csize = temp_npages;
-		}
+	lock_acquire(as->as_lock);
+	result = as_writeback(as, rg, rg->rg_vbase,
+			      rg->rg_vbase + rg->rg_npages * PAGE_SIZE);
+	if (result) {
+		/* Keep the mapping, so the changes are not lost. */
+		lock_release(as->as_lock);
+		return result;
 	}
-	else{
-		kprintf("continuebit != temp_npages, not enough more menmory\n");
+	as_freerange(as, rg->rg_vbase,
+		     rg->rg_vbase + rg->rg_npages * PAGE_SIZE);
+	v = rg->rg_vnode;
+	*rg = as->as_maps[--as->as_nmaps];
+	lock_release(as->as_lock);
+
+	if (v != NULL) {
+		VOP_DECREF(v);
+	}
+	return 0;
+}
 
-	} 
+int
+as_msync(struct addrspace *as, vaddr_t addr, size_t len)
+{
+	struct region *rg;
+	int result;
 
-	spinlock_release(&stealmem_lock);
-	return addr;
-	#endif /* OPT_A3 */
+	if ((addr & ~(vaddr_t)PAGE_FRAME) != 0) {
+		return EINVAL;
+	}
+	rg = as_find_region(as, addr);
+	if (rg == NULL || rg < as->as_maps || rg >= as->as_maps + AS_MAXMAPS ||
+	    len > rg->rg_vbase + rg->rg_npages * PAGE_SIZE - addr) {
+		return ENOMEM;
+	}
+
+	lock_acquire(as->as_lock);
+	result = as_writeback(as, rg, addr, addr + len);
+	lock_release(as->as_lock);
+	return result;
 }
 
-/* Allocate/free some kernel-space virtual pages */
-vaddr_t 
-alloc_kpages(int npages)
+void
+vm_setstacklimit(unsigned npages)
 {
-	paddr_t pa;
-	pa = getppages(npages);
-	if (pa==0) {
-		return 0;
-	}
-	return PADDR_TO_KVADDR(pa);
+	KASSERT(npages > 0);
+	vm_stacklimit = npages;
 }
 
+unsigned
+vm_getstacklimit(void)
+{
+	return vm_stacklimit;
+}
 
-//same as getppage
+/*
+ * Entries preloaded by fault-around, summed over cpus.
+ */
 static
-void
-abandonppages(paddr_t addr)
+unsigned
+fa_loadcount(void)
 {
-	int loc = -1;
-	int temp;
-	spinlock_acquire(&stealmem_lock);	
+	unsigned i, n, loads;
 
-	for (int i = 0; i < numofframes; ++i){
-		if (core_map[i].paddr == addr){
-			loc = i;
-			temp = core_map[loc].csize;
-			break;
-		}
+	loads = 0;
+	n = cpu_count();
+	for (i=0; i<n; i++) {
+		loads += cpu_get(i)->c_faloads;
 	}
+	return loads;
+}
 
-	for (int x = loc; core_map[x].csize == temp; x++){
-		core_map[x].csize = 0;
+void
+vm_setfaultaround(unsigned npages)
+{
+	if (npages > VM_FAULTAROUND_MAX) {
+		npages = VM_FAULTAROUND_MAX;
 	}
-			
-	spinlock_release(&stealmem_lock);
+	vm_faultaround = npages;
+	fa_basefaults = vmstats_get(VMSTAT_TLB_FAULT);
+	fa_baserefills = vm_fastrefills;
+	fa_baseloads = fa_loadcount();
 }
 
-
-void 
-free_kpages(vaddr_t addr)
+void
+vm_printfaultaround(void)
 {
-	/* nothing - leak the memory. */
+	unsigned faults, refills, loads;
 
-	//(void)addr;
-	//free the same number of pages that was allocated.
-	addr = K_TO_P(addr);
-	#if OPT_A3
-	abandonppages(addr);
-	#endif /* OPT_A3 */
+	faults = vmstats_get(VMSTAT_TLB_FAULT) - fa_basefaults;
+	refills = vm_fastrefills - fa_baserefills;
+	loads = fa_loadcount() - fa_baseloads;
+
+	if (vm_faultaround == 0) {
+		kprintf("Fault-around off\n");
+	}
+	else {
+		kprintf("Fault-around %u pages (at most %u)\n",
+			vm_faultaround, VM_FAULTAROUND_MAX);
+	}
+	kprintf("  %u TLB faults, %u fast refills, %u entries preloaded\n",
+		faults, refills, loads);
 }
 
 void
-vm_tlbshootdown_all(void)
+vm_setasids(bool on)
 {
-
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	asid_tagging = on;
+	asid_basefaults = vmstats_get(VMSTAT_TLB_FAULT);
+	asid_baseswitches = vmstats_get(VMSTAT_AS_ACTIVATE);
+	asid_baserollovers = vmstats_get(VMSTAT_ASID_ROLLOVER);
+	asid_baserefills = vm_fastrefills;
 }
 
 void
-vm_tlbshootdown(const struct tlbshootdown *ts)
+vm_printasidstats(void)
 {
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	unsigned faults, switches, rollovers, refills;
+
+	/* Misses the refill handler served never reach vm_fault. */
+	refills = vm_fastrefills - asid_baserefills;
+	faults = vmstats_get(VMSTAT_TLB_FAULT) - asid_basefaults + refills;
+	switches = vmstats_get(VMSTAT_AS_ACTIVATE) - asid_baseswitches;
+	rollovers = vmstats_get(VMSTAT_ASID_ROLLOVER) - asid_baserollovers;
+
+	kprintf("ASID tagging %s\n", asid_tagging ? "on" : "off");
+	kprintf("  %u TLB faults (%u fast refills), %u switches, "
+		"%u rollovers\n", faults, refills, switches, rollovers);
+	if (switches > 0) {
+		kprintf("  %u.%02u TLB faults per switch\n",
+			faults / switches, faults * 100 / switches % 100);
+	}
 }
 
+#else /* !OPT_A3 */
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
@@ -225,17 +1992,13 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	uint32_t ehi, elo;
 	struct addrspace *as;
 	int spl;
-	bool read_only = 0;
-
 
 	faultaddress &= PAGE_FRAME;
 
 	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
+
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
-	    	#if OPT_A3    
-	    		return EFAULT;
-			#endif /* OPT_A3 */
 		/* We always create pages read-write, so we can't get this */
 		panic("dumbvm: got VM_FAULT_READONLY\n");
 	    case VM_FAULT_READ:
@@ -285,8 +2048,6 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	stacktop = USERSTACK;
 
 	if (faultaddress >= vbase1 && faultaddress < vtop1) {
-		read_only = 1;
-
 		paddr = (faultaddress - vbase1) + as->as_pbase1;
 	}
 	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
@@ -312,44 +2073,15 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		}
 		ehi = faultaddress;
 		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-
-		#if OPT_A3
-		if(as->elf_flag && read_only){
-			elo&=~TLBLO_DIRTY;
-		}
-		#endif /* OPT_A3 */
-
 		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
 		tlb_write(ehi, elo, i);
 		splx(spl);
 		return 0;
 	}
 
-
-	#if OPT_A3
-		/*
-		 *   tlb_random: write the TLB entry specified by ENTRYHI and ENTRYLO
-		 *        into a "random" TLB slot chosen by the processor.
-		 *
-		 *        IMPORTANT NOTE: never write more than one TLB entry with the
-		 *        same virtual page field.
-		*/	
-		//void tlb_random(uint32_t entryhi, uint32_t entrylo);
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		if(as->elf_flag && read_only){
-			elo&=~TLBLO_DIRTY;
-		}
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-		tlb_random(ehi, elo);
-		splx(spl);
-		return 0;
-
-		//	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
-		//	splx(spl);
-	//	return EFAULT;
-	#endif /* OPT_A3 */
-
+	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
+	splx(spl);
+	return EFAULT;
 }
 
 struct addrspace *
@@ -360,11 +2092,6 @@ as_create(void)
 		return NULL;
 	}
 
-	#if OPT_A3
-	as->elf_flag = 0;
-	#endif /* OPT_A3 */
-
-
 	as->as_vbase1 = 0;
 	as->as_pbase1 = 0;
 	as->as_npages1 = 0;
@@ -379,43 +2106,9 @@ as_create(void)
 void
 as_destroy(struct addrspace *as)
 {
-	free_kpages(PADDR_TO_KVADDR(as->as_stackpbase));
-	free_kpages(PADDR_TO_KVADDR(as->as_pbase2));
-	free_kpages(PADDR_TO_KVADDR(as->as_pbase1));
 	kfree(as);
 }
 
-void
-as_activate(void)
-{
-	int i, spl;
-	struct addrspace *as;
-
-	as = curproc_getas();
-#ifdef UW
-        /* Kernel threads don't have an address spaces to activate */
-#endif
-	if (as == NULL) {
-		return;
-	}
-
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
-
-	splx(spl);
-}
-
-void
-as_deactivate(void)
-{
-
-	/* nothing */
-}
-
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		 int readable, int writeable, int executable)
@@ -459,7 +2152,6 @@ static
 void
 as_zero_region(paddr_t paddr, unsigned npages)
 {
-
 	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
 }
 
@@ -470,27 +2162,20 @@ as_prepare_load(struct addrspace *as)
 	KASSERT(as->as_pbase2 == 0);
 	KASSERT(as->as_stackpbase == 0);
 
-	as->as_pbase1 = getppages(as->as_npages1);
+	as->as_pbase1 = getppages(as->as_npages1, as);
 	if (as->as_pbase1 == 0) {
-//		kprintf("getting page for as->as_pbase1\n");				
 		return ENOMEM;
 	}
-//	as_zero_region(as->as_pbase1,as->as_npages1);
 
-
-	as->as_pbase2 = getppages(as->as_npages2);
+	as->as_pbase2 = getppages(as->as_npages2, as);
 	if (as->as_pbase2 == 0) {
-//		kprintf("getting page for as->as_pbase2\n");		
 		return ENOMEM;
 	}
-//	as_zero_region(as->as_pbase2,as->as_npages2);
 
-	as->as_stackpbase = getppages(DUMBVM_STACKPAGES);
+	as->as_stackpbase = getppages(DUMBVM_STACKPAGES, as);
 	if (as->as_stackpbase == 0) {
-//		kprintf("getting page for as->as_stackpbase\n");		
 		return ENOMEM;
 	}
-//	as_zero_region(as->as_stackpbase,DUMBVM_STACKPAGES);
 	
 	as_zero_region(as->as_pbase1, as->as_npages1);
 	as_zero_region(as->as_pbase2, as->as_npages2);
@@ -502,10 +2187,6 @@ as_prepare_load(struct addrspace *as)
 int
 as_complete_load(struct addrspace *as)
 {
-	#if OPT_A3
-	as->elf_flag = 1;
-	#endif /* OPT_A3 */
-
 	(void)as;
 	return 0;
 }
@@ -555,12 +2236,89 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
 		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
 		DUMBVM_STACKPAGES*PAGE_SIZE);
-
-//	KASSERT((new->as_vbase1 & PAGE_FRAME) == new->as_vbase1);
-//	KASSERT((new->as_pbase1 & PAGE_FRAME) == new->as_pbase1);
-//	KASSERT((new->as_vbase2 & PAGE_FRAME) == new->as_vbase2);
-//	KASSERT((new->as_pbase2 & PAGE_FRAME) == new->as_pbase2);
 	
 	*ret = new;
 	return 0;
 }
+
+#endif /* OPT_A3 */
+
+void
+as_activate(void)
+{
+	int i, spl;
+	struct addrspace *as;
+#if OPT_A3
+	bool flush, rollover;
+	uint32_t pid;
+#endif
+
+	as = curproc_getas();
+#ifdef UW
+        /* Kernel threads don't have an address spaces to activate */
+#endif
+	if (as == NULL) {
+		return;
+	}
+
+#if OPT_A3
+	(void)i;
+
+	spl = splhigh();
+	spinlock_acquire(&asid_lock);
+	rollover = false;
+	if (as->as_asidgen != asid_gen) {
+		if (asid_next == NUM_TLBPID) {
+			asid_gen++;
+			asid_next = ASID_FIRST;
+			rollover = true;
+		}
+		as->as_asid = asid_next++;
+		as->as_asidgen = asid_gen;
+		as->as_cpus = 0;
+	}
+	as->as_cpus |= (uint32_t)1 << curcpu->c_number;
+	/* Entries from an older generation may carry reused PIDs. */
+	flush = !asid_tagging || curcpu->c_asidgen != asid_gen;
+	curcpu->c_asidgen = asid_gen;
+	pid = as_pid(as);
+	spinlock_release(&asid_lock);
+
+	cpupagetables[curcpu->c_number] = (vaddr_t)as->as_pt->pt_dir;
+
+	if (flush) {
+		tlb_flush();
+	}
+	tlb_setpid(pid);
+	splx(spl);
+
+	vmstats_inc(VMSTAT_AS_ACTIVATE);
+	if (rollover) {
+		vmstats_inc(VMSTAT_ASID_ROLLOVER);
+	}
+#else
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+
+	splx(spl);
+#endif /* OPT_A3 */
+}
+
+void
+as_deactivate(void)
+{
+#if OPT_A3
+	int spl;
+
+	/* Misses now go to vm_fault, which finds no address space. */
+	spl = splhigh();
+	cpupagetables[curcpu->c_number] = 0;
+	splx(spl);
+#else
+	/* nothing */
+#endif /* OPT_A3 */
+}
@@ -40,6 +40,41 @@
 
 
 struct vnode;
+#if OPT_A3
+struct lock;
+struct pagetable;
+
+/*
+ * A region of the address space: a page-aligned range of user
+ * addresses plus where its contents come from. Nothing is read or
+ * zeroed when the region is set up; vm_fault fills each page the
+ * first time it is touched. Bytes in
+ * [rg_filevaddr, rg_filevaddr + rg_filesz) come from the file
+ * starting at rg_offset, everything else in the region reads as zero.
+ * The file is the executable, except for mmap regions, which name
+ * their own in rg_vnode.
+ *
+ * Pages of a shared mapping (rg_shared) stay shared with children
+ * after fork, and for a file are written back to it by msync, munmap
+ * and exit. They are kept resident until then.
+ */
+struct region {
+  vaddr_t rg_vbase;               /* page aligned */
+  size_t rg_npages;
+  bool rg_writeable;
+  vaddr_t rg_filevaddr;           /* first byte backed by the file */
+  off_t rg_offset;                /* file offset of rg_filevaddr */
+  size_t rg_filesz;               /* bytes backed by the file; 0 if none */
+  struct vnode *rg_vnode;         /* mapped file; NULL if executable */
+  bool rg_shared;                 /* MAP_SHARED mapping */
+};
+
+/* ELF segments an address space may define (text and data). */
+#define AS_MAXREGIONS 2
+
+/* mmap regions per address space. */
+#define AS_MAXMAPS    16
+#endif /* OPT_A3 */
 
 
 /* 
@@ -50,11 +85,22 @@ struct vnode;
  */
 
 struct addrspace {
-
-  #if OPT_A3
-  bool elf_flag;
-  #endif /* OPT_A3 */
-
+#if OPT_A3
+  struct lock *as_lock;           /* page table vs. pageout */
+  struct pagetable *as_pt;        /* per-page frame, protection, valid */
+  struct region as_regions[AS_MAXREGIONS];
+  unsigned as_nregions;
+  struct region as_stack;
+  struct region as_heap;          /* pages covering [base, as_brk) */
+  vaddr_t as_brk;                 /* current break, not page aligned */
+  struct region as_maps[AS_MAXMAPS];  /* mmap regions, unordered */
+  unsigned as_nmaps;
+  struct vnode *as_vnode;         /* executable, held for demand loading */
+  unsigned as_asid;               /* TLB PID, valid in generation... */
+  unsigned as_asidgen;            /* ...as_asidgen; 0 if none yet */
+  uint32_t as_cpus;               /* cpus that have used that PID */
+  unsigned as_stackmax;           /* stack rlimit, in pages */
+#else
   vaddr_t as_vbase1;
   paddr_t as_pbase1;
   size_t as_npages1;
@@ -62,6 +108,7 @@ struct addrspace {
   paddr_t as_pbase2;
   size_t as_npages2;
   paddr_t as_stackpbase;
+#endif /* OPT_A3 */
 };
 
 /*
@@ -92,12 +139,34 @@ struct addrspace {
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
+ *    as_map_segment - record that a region is backed by part of an
+ *                executable. Nothing is read until the pages are
+ *                touched.
+ *
  *    as_complete_load - this is called when loading from an executable
  *                is complete.
  *
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_sbrk   - move the break (the end of the heap, which starts
+ *                just above the executable's segments) by AMOUNT
+ *                bytes, handing back the old break. Growth is filled
+ *                with zeroes on demand; shrinking releases the pages
+ *                above the new break.
+ *
+ *    as_mmap   - map LEN bytes of file V (NULL for zeroes) from OFFSET,
+ *                somewhere between the heap and the stack, handing back
+ *                the address chosen. The file must already have passed
+ *                VOP_MMAP. PROT_NONE, and unknown PROT or MAP bits,
+ *                are refused with EINVAL.
+ *
+ *    as_munmap - remove the whole mapping at ADDR of LEN bytes,
+ *                writing back what a shared one changed.
+ *
+ *    as_msync  - write back what has changed in [ADDR, ADDR + LEN) of
+ *                a shared file mapping.
  */
 
 struct addrspace *as_create(void);
@@ -112,8 +181,22 @@ int               as_define_region(struct addrspace *as,
                                    int writeable,
                                    int executable);
 int               as_prepare_load(struct addrspace *as);
+#if OPT_A3
+int               as_map_segment(struct addrspace *as, struct vnode *v,
+                                 off_t offset, vaddr_t vaddr,
+                                 size_t filesz);
+#endif /* OPT_A3 */
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+#if OPT_A3
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbrk);
+int               as_mmap(struct addrspace *as, size_t len, int prot,
+                          int flags, struct vnode *v, off_t offset,
+                          vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t addr, size_t len);
+int               as_msync(struct addrspace *as, vaddr_t addr, size_t len);
+#endif /* OPT_A3 */
 
 
 /*
@@ -3,18 +3,226 @@
 #include <spinlock.h>
 #include <vm.h>
 
-struct coremap{
-	int csize;
-	paddr_t paddr;
+/*
+ * Coremap: one entry per physical frame that the VM system manages.
+ *
+ * Free frames are handed out by a binary buddy allocator. Every
+ * block of 2^k frames starts on a frame index that is a multiple of
+ * 2^k, so the buddy of the block at index i is at index i ^ 2^k.
+ * Only the first entry ("head") of a block carries its state and
+ * order; all other entries are CM_TAIL.
+ *
+ * The free list links are frame indices rather than pointers so the
+ * entries stay small. CM_NONE terminates a list.
+ *
+ * A frame's entry is found from its physical address by index
+ * arithmetic (see PADDR_TO_FRAME in coremap.c), never by searching.
+ * Allocations are exact: a request for n pages takes the smallest
+ * block that fits and hands the unused tail straight back, and the
+ * head entry records n and the owning address space so the free
+ * path knows precisely what to release.
+ */
+
+/* Largest block the allocator knows about is 2^CM_MAXORDER pages. */
+#define CM_MAXORDER   12
+#define CM_NORDERS    (CM_MAXORDER + 1)
+
+#define CM_NONE       (-1)
+
+/* Entry states */
+#define CM_TAIL       0		/* not the head of any block */
+#define CM_FREE       1		/* head of a free block */
+#define CM_ALLOCATED  2		/* head of an allocated block */
+#define CM_CACHED     3		/* single frame held in a pagecache */
+#define CM_ZEROED     4		/* single frame in the pre-zeroed pool */
+
+struct addrspace;
+
+struct coremap {
+	int cm_next;			/* next on free or evictable list */
+	int cm_prev;			/* previous on free or evictable list */
+	uint8_t cm_state;		/* CM_TAIL, CM_FREE, CM_ALLOCATED */
+	uint8_t cm_order;		/* log2 of block size (free heads) */
+	uint16_t cm_refcount;		/* mappings of the block (alloc heads) */
+	uint8_t cm_flags;		/* CM_EVICTABLE etc. (alloc heads) */
+	unsigned cm_npages;		/* allocation length (alloc heads) */
+	struct addrspace *cm_owner;	/* NULL for kernel (alloc heads) */
+	vaddr_t cm_vaddr;		/* user address (CM_EVICTABLE heads) */
 };
 
 /*
-struct coremap {
-	unsigned long csize;
-	struct spinlock coremap_lock;
-	struct entry *coremap_entry;
+ * Flags for user frames. Only changed with the coremap lock held.
+ * An evictable frame is a single private page mapped at cm_vaddr in
+ * cm_owner. A pinned frame has been picked by the pageout code and
+ * must not be freed until it is unpinned.
+ *
+ * Evictable frames are also kept on a list in the order they became
+ * evictable, threaded through cm_next/cm_prev (which an allocated
+ * block does not otherwise use). The replacement policies work from
+ * that list.
+ */
+#define CM_EVICTABLE  0x01
+#define CM_PINNED     0x02
+
+/*
+ * Page replacement policies, selectable at run time.
+ *
+ * MIPS has no hardware reference bit, so it is kept in software, as
+ * one "idle" byte per frame outside struct coremap: zero means the
+ * frame has been referenced since the clock last looked at it. It is
+ * cleared whenever a translation for the frame is loaded into the
+ * TLB, by coremap_touch from vm_fault or directly by the UTLB refill
+ * handler, which finds the byte for a frame at physical address PA
+ * at coremap_idlebase + PA / PAGE_SIZE. The clock policy gives a
+ * referenced frame a second chance: it marks it idle and hands the
+ * page's address back in a struct cm_sweep so that the caller can
+ * knock the translation out of every TLB. The next access then
+ * refills, and marks the frame referenced again. FIFO and random
+ * ignore the bytes.
+ */
+#define CM_POLICY_CLOCK   0
+#define CM_POLICY_FIFO    1
+#define CM_POLICY_RANDOM  2
+#define CM_NPOLICIES      3
+
+/* Translations the clock may ask to have flushed per call. */
+#define CM_SWEEPMAX   8
+
+struct cm_sweep {
+	unsigned cs_count;
+	vaddr_t cs_vaddr[CM_SWEEPMAX];
+};
+
+/* Events counted per policy by coremap_count. */
+#define CM_COUNT_FAULT    0	/* page fault that needed a frame */
+#define CM_COUNT_SWAPIN   1	/* ...and was satisfied from swap */
+#define CM_COUNT_EVICT    2	/* page written out and its frame freed */
+#define CM_NCOUNTS        3
+
+/*
+ * Per-cpu cache of free single frames ("magazine"), kept in struct
+ * cpu. One-page allocations and frees are served from here with
+ * interrupts off and no lock; the global allocator is only touched
+ * to refill an empty cache or drain a full one, PAGECACHE_BATCH
+ * frames at a time. Cached frames look allocated to the buddy
+ * allocator (state CM_CACHED) so they are never coalesced.
+ */
+#define PAGECACHE_SIZE   16
+#define PAGECACHE_BATCH  8
+
+struct pagecache {
+	paddr_t pc_frames[PAGECACHE_SIZE];
+	unsigned pc_count;		/* frames currently cached */
+	unsigned pc_allochits;		/* allocs served from the cache */
+	unsigned pc_allocmisses;	/* allocs that needed a refill */
+	unsigned pc_freehits;		/* frees absorbed by the cache */
+	unsigned pc_freemisses;		/* frees that needed a drain */
 };
-*/
-struct coremap *newcoremap (void);
 
-#endif /* _COREMAP_H_ */ 
+/*
+ * Pool of frames zeroed ahead of time, for pages that start out as
+ * zeroes (BSS, heap, stack). A kernel thread keeps it topped up to
+ * ZEROPOOL_HIGH frames whenever it falls below ZEROPOOL_LOW, taking
+ * only frames that are free anyway and never dipping below
+ * ZEROPOOL_RESERVE free frames to do so. The pool is linked through
+ * cm_next. It is handed back to the buddy lists if an allocation
+ * would otherwise fail.
+ */
+#define ZEROPOOL_HIGH     64
+#define ZEROPOOL_LOW      16
+#define ZEROPOOL_RESERVE  32
+
+/* Call once from vm_bootstrap, after which ram_stealmem is off limits. */
+void coremap_bootstrap(void);
+
+/*
+ * Start the pre-zeroing thread, and make the synchronization objects
+ * the coremap needs. Call from vm_bootstrap once kmalloc works.
+ */
+void coremap_zero_bootstrap(void);
+
+/*
+ * Give this cpu's cached frames back to the buddy lists. Called from
+ * interprocessor_interrupt for IPI_PAGECACHE.
+ */
+void coremap_pagecache_ipi(void);
+
+/*
+ * Allocate NPAGES physically contiguous frames on behalf of OWNER
+ * (NULL for the kernel); returns 0 if there is no block large
+ * enough. Free with coremap_free, passing the address that
+ * coremap_alloc returned; exactly NPAGES frames are released.
+ */
+paddr_t coremap_alloc(unsigned long npages, struct addrspace *owner);
+void coremap_free(paddr_t paddr);
+
+/*
+ * Take one already zeroed frame for OWNER from the pre-zeroed pool;
+ * returns 0 if the pool is empty, in which case the caller should
+ * allocate and zero a frame itself. Free it with coremap_free.
+ */
+paddr_t coremap_alloc_zeroed(struct addrspace *owner);
+
+/*
+ * Reference counts for single frames shared copy-on-write. A new
+ * allocation has one reference; coremap_share adds one, and
+ * coremap_free drops one, releasing the frame with the last.
+ * coremap_refcount is exact only when the caller holds one of the
+ * references and no other holder can be sharing it concurrently.
+ */
+void coremap_share(paddr_t paddr);
+unsigned coremap_refcount(paddr_t paddr);
+
+/*
+ * Record that the single user frame PADDR is mapped privately at
+ * VADDR in OWNER, making it a candidate for eviction. Sharing the
+ * frame (coremap_share) or freeing it withdraws it again.
+ */
+void coremap_map(paddr_t paddr, struct addrspace *owner, vaddr_t vaddr);
+
+/*
+ * Note that the frame at PADDR has just been loaded into a TLB. Done
+ * without the lock; a racing clock sweep at worst costs one extra
+ * fault.
+ */
+void coremap_touch(paddr_t paddr);
+extern vaddr_t coremap_idlebase;
+
+/*
+ * Pick an evictable frame with the current policy and pin it,
+ * returning its owner and user address; returns 0 if there is none.
+ * The pageout code must coremap_unpin it whether or not it ends up
+ * evicting it. Freeing a pinned frame waits until it is unpinned, so
+ * the owner cannot go away underneath the caller.
+ *
+ * The clock policy fills in SWEEP with the addresses whose reference
+ * bits it cleared; the caller must flush those from every TLB, and
+ * may then call again if no frame was returned. A full sweep ends
+ * the call early. If SWEEP is NULL, reference bits are ignored.
+ */
+paddr_t coremap_pin_victim(struct addrspace **owner, vaddr_t *vaddr,
+			   struct cm_sweep *sweep);
+void coremap_unpin(paddr_t paddr);
+
+/*
+ * Select the replacement policy by name ("clock", "fifo", "random").
+ * Returns EINVAL if there is no such policy.
+ */
+int coremap_setpolicy(const char *name);
+
+/* Count event WHAT (a CM_COUNT_* value) against the current policy. */
+void coremap_count(unsigned what);
+
+/*
+ * Print free list occupancy for each order, per-cpu pagecache and
+ * zero pool hit rates (menu command "cm").
+ */
+void coremap_printstats(void);
+
+/*
+ * Print eviction counts and fault rates for each replacement policy
+ * (menu command "evict").
+ */
+void coremap_printpolicies(void);
+
+#endif /* _COREMAP_H_ */
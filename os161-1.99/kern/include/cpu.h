@@ -34,6 +34,29 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include <coremap.h>     /* for struct pagecache */
+#include <uw-vmstats.h>  /* for VMSTAT_COUNT */
+
+/*
+ * Per-cpu magazines of free kmalloc blocks, a pair for each subpage
+ * block size; see kmalloc.c. Used only with interrupts off.
+ */
+#define KMAG_NSIZES   8
+#define KMAG_ROUNDS   16
+
+struct kmag {
+	void *km_blocks[KMAG_ROUNDS];
+	unsigned km_count;		/* blocks in km_blocks */
+};
+
+struct kmagcpu {
+	struct kmag kmc_loaded[KMAG_NSIZES];	/* allocated from, freed to */
+	struct kmag kmc_previous[KMAG_NSIZES];	/* swapped with loaded */
+	unsigned kmc_allochits;		/* allocs served by a magazine */
+	unsigned kmc_allocmisses;	/* ...that needed the depot or heap */
+	unsigned kmc_freehits;		/* frees absorbed by a magazine */
+	unsigned kmc_freemisses;	/* ...that needed the depot or heap */
+};
 
 
 /*
@@ -59,7 +82,14 @@ struct cpu {
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
+	struct threadlist c_threadcache; /* Exited threads kept for reuse */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	struct pagecache c_pagecache;	/* Free frames (splhigh to use) */
+	unsigned c_asidgen;		/* ASID generation of our TLB */
+	unsigned c_tlbnext;		/* Next TLB slot to check for free */
+	unsigned c_faloads;		/* TLB entries fault-around preloaded */
+	unsigned c_vmstats[VMSTAT_COUNT]; /* our share of the VM stats */
+	struct kmagcpu c_kmag;		/* kmalloc magazines (splhigh to use) */
 
 	/*
 	 * Accessed by other cpus.
@@ -68,6 +98,8 @@ struct cpu {
 	bool c_isidle;			/* True if this cpu is idle */
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
+	unsigned c_steals;		/* Times we stole threads */
+	unsigned c_migrations;		/* Threads we stole */
 
 	/*
 	 * Accessed by other cpus.
@@ -106,6 +138,14 @@ struct cpu {
  */
 struct cpu *cpu_create(unsigned hardware_number);
 void cpu_machdep_init(struct cpu *);
+
+/*
+ * Number of CPUs, and the CPU with a given software number, for code
+ * outside the thread system that keeps per-cpu state. CPUs are never
+ * removed, so the result of cpu_get stays valid.
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned number);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
@@ -152,6 +192,8 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_batch queues N mappings and sends a single IPI
+ * for all of them.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -162,10 +204,13 @@ void cpu_halt(void);
 #define IPI_OFFLINE		1	/* CPU is requested to go offline */
 #define IPI_UNIDLE		2	/* Runnable threads are available */
 #define IPI_TLBSHOOTDOWN	3	/* MMU mapping(s) need invalidation */
+#define IPI_PAGECACHE		4	/* Cached free frames are wanted back */
 
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_batch(struct cpu *target,
+			    const struct tlbshootdown *mappings, unsigned n);
 
 void interprocessor_interrupt(void);
 
@@ -0,0 +1,57 @@
+#ifndef _KMEMCACHE_H_
+#define _KMEMCACHE_H_
+
+/*
+ * Object caches ("slab" allocator).
+ *
+ * A cache hands out objects of one type and size, carved from whole
+ * pages ("slabs") that hold nothing else, so sizes that fall between
+ * the kmalloc buckets waste no space and every object lives in a
+ * slab its own cache owns. Freeing an object finds its slab from the
+ * page address alone.
+ *
+ * If the cache has a constructor, it runs on each object once, when
+ * its slab is set up, and the destructor runs when the slab is given
+ * back; an object freed to the cache stays constructed and the next
+ * allocation gets it back as is. So kmem_cache_free must be passed an
+ * object in its constructed state (e.g. a lock with no holder), and
+ * whatever the constructor sets up does not have to be redone on
+ * every allocation. A constructor returns 0 or an error code, in
+ * which case the allocation that needed the slab fails.
+ *
+ * Each cache keeps up to KMEM_MAXEMPTY wholly free slabs around for
+ * reuse; beyond that free slabs go back to the page allocator.
+ *
+ * Objects must fit in one page along with the slab header.
+ */
+
+struct kmem_cache;
+
+typedef int (*kmem_ctor)(void *obj);
+typedef void (*kmem_dtor)(void *obj);
+
+#define KMEM_MAXEMPTY  1
+
+/*
+ * Create a cache of SIZE-byte objects. CTOR and DTOR may be NULL.
+ * NAME is not copied. Returns NULL if out of memory.
+ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     kmem_ctor ctor, kmem_dtor dtor);
+
+/* Destroy a cache. All of its objects must have been freed. */
+void kmem_cache_destroy(struct kmem_cache *kc);
+
+/* Get an object, or NULL if out of memory. */
+void *kmem_cache_alloc(struct kmem_cache *kc);
+
+/* Give back an object from kmem_cache_alloc on the same cache. */
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+
+/*
+ * Print object counts and constructor calls for every cache (menu
+ * command "slab").
+ */
+void kmem_cache_printstats(void);
+
+#endif /* _KMEMCACHE_H_ */
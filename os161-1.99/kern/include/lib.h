@@ -89,6 +89,7 @@
 #define DB_NETFS       0x0400
 #define DB_KMALLOC     0x0800
 #define DB_SYNCPROB    0x1000
+#define DB_VMSTAT      0x2000	/* per-process VM stats at exit */
 
 extern uint32_t dbflags;
 
@@ -127,6 +128,15 @@ void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
 
+/*
+ * Allocation profile by call site, and unfreed blocks (menu command
+ * "kmprof"). Only does anything in a kernel built with options
+ * kmprof. kmprof_reset starts the per-site totals over and sets the
+ * point after which unfreed blocks are reported.
+ */
+void kmprof_printstats(void);
+void kmprof_reset(void);
+
 /*
  * C string functions. 
  *
@@ -0,0 +1,90 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+#include <vm.h>
+
+/*
+ * Per-address-space page table.
+ *
+ * Two levels, in the shape of the MIPS virtual address: the top 10
+ * bits select a directory entry, the next 10 select a PTE within a
+ * one-page second-level table, and the low 12 are the page offset.
+ * Only the user half of the address space (below USERSPACETOP) is
+ * described, so the directory has half the usual 1024 entries.
+ * Second-level tables are allocated the first time a page in their
+ * 4M range is mapped, so a sparse address space costs one page of
+ * PTEs per 4M actually in use.
+ *
+ * A PTE holds the physical frame in its top 20 bits (PTE_FRAME) and
+ * flag bits below. PTE_VALID and PTE_WRITE sit where the MIPS TLB
+ * keeps its valid and dirty (write enable) bits, and the other flags
+ * in the low byte, which the TLB ignores: a resident PTE with its low
+ * byte cleared is its own TLBLO value. The UTLB refill handler in
+ * exception-mips1.S relies on this, and has PTE_VALID hardwired. A
+ * zero PTE means "never touched": the page is filled from its region
+ * (file or zeroes) on first fault.
+ *
+ * fork shares frames instead of copying them. A writeable page is
+ * then marked PTE_COW with PTE_WRITE cleared in both parent and
+ * child, so the first write takes a VM_FAULT_READONLY and vm_fault
+ * gives the writer its own copy.
+ *
+ * An evicted page has PTE_VALID clear and PTE_SWAPPED set, with its
+ * swap slot in place of the frame number; PTE_WRITE is kept. Shared
+ * (PTE_COW) pages are never evicted.
+ *
+ * PTE_TEXT marks a read-only page whose frame is shared through the
+ * text cache (see textcache.h). PTE_SHARED marks a page of a shared
+ * mmap region; for these PTE_WRITE doubles as the dirty bit, being
+ * set only by the first write after the page was last written back.
+ * Neither kind is ever evicted.
+ */
+
+typedef uint32_t pte_t;
+
+#define PTE_FRAME      PAGE_FRAME	/* physical frame number bits */
+#define PTE_VALID      0x00000200	/* frame is resident (TLBLO_VALID) */
+#define PTE_WRITE      0x00000400	/* user may write (TLBLO_DIRTY) */
+#define PTE_COW        0x00000004	/* shared; copy before writing */
+#define PTE_SWAPPED    0x00000008	/* not resident; frame bits hold slot */
+#define PTE_TEXT       0x00000010	/* frame is in the text cache */
+#define PTE_SHARED     0x00000020	/* page of a MAP_SHARED region */
+
+/* Swap slot number kept in the frame bits of a PTE_SWAPPED entry. */
+#define PTE_TOSLOT(pte)    ((unsigned)((pte) >> PT_L2SHIFT))
+#define PTE_FROMSLOT(slot) ((pte_t)(slot) << PT_L2SHIFT)
+
+#define PT_L1SHIFT     22
+#define PT_L2SHIFT     12
+#define PT_L1ENTRIES   (USERSPACETOP >> PT_L1SHIFT)
+#define PT_L2ENTRIES   (PAGE_SIZE / sizeof(pte_t))
+
+#define PT_L1INDEX(va) ((va) >> PT_L1SHIFT)
+#define PT_L2INDEX(va) (((va) >> PT_L2SHIFT) & (PT_L2ENTRIES - 1))
+
+struct pagetable {
+	pte_t *pt_dir[PT_L1ENTRIES];	/* second-level tables, or NULL */
+};
+
+struct pagetable *pt_create(void);
+
+/*
+ * Frees the table pages themselves. The caller must already have
+ * released whatever the PTEs refer to (see pt_walk).
+ */
+void pt_destroy(struct pagetable *pt);
+
+/*
+ * Return a pointer to the PTE for user address VA. If there is no
+ * second-level table for VA, return NULL unless CREATE is set, in
+ * which case allocate one (NULL again if out of memory).
+ */
+pte_t *pt_lookup(struct pagetable *pt, vaddr_t va, bool create);
+
+/*
+ * Call FUNC(va, pte, data) for every nonzero PTE in ascending address
+ * order. Stops and returns the first nonzero value FUNC returns.
+ */
+typedef int (*pt_walkfunc)(vaddr_t va, pte_t *pte, void *data);
+int pt_walk(struct pagetable *pt, pt_walkfunc func, void *data);
+
+#endif /* _PAGETABLE_H_ */
@@ -30,6 +30,7 @@
 #ifndef _PROC_H_
 #define _PROC_H_
 #include "opt-A2.h"
+#include "opt-A3.h"
 /*
  * Definition of a process.
  *
@@ -38,6 +39,7 @@
 
 #include <spinlock.h>
 #include <thread.h> /* required for struct threadarray */
+#include <uw-vmstats.h> /* for VMSTAT_COUNT */
 
 struct addrspace;
 struct vnode;
@@ -88,6 +90,10 @@ struct proc {
           // out if you are just inserting new code for ASST2
 
     #endif /* OPT_A2 */
+
+#if OPT_A3
+	unsigned p_vmstats[VMSTAT_COUNT]; /* VM stats charged to us */
+#endif /* OPT_A3 */
 };
 
 /* This is the process structure for the kernel and for kernel-only threads. */
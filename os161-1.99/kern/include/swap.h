@@ -0,0 +1,32 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+#include <vm.h>
+
+/*
+ * Swap space: page-sized slots on a raw disk device, handed out from
+ * a bitmap. A page that has been evicted lives in exactly one slot,
+ * recorded in its PTE (see pagetable.h), until it is faulted back in
+ * or its address space goes away.
+ */
+
+#define SWAP_DEVICE   "lhd0raw:"
+
+/*
+ * Open the swap device. Call once from vm_bootstrap; if there is no
+ * device, paging is left off and swap_alloc always fails.
+ */
+void swap_bootstrap(void);
+
+/* Get a free slot in *SLOT. Returns ENOSPC if swap is full or absent. */
+int swap_alloc(unsigned *slot);
+void swap_free(unsigned slot);
+
+/*
+ * Copy one page between physical frame PADDR and SLOT. These may
+ * sleep. They do not touch the vmstats counters; callers know
+ * whether the transfer was a fault or not.
+ */
+int swap_in(unsigned slot, paddr_t paddr);
+int swap_out(unsigned slot, paddr_t paddr);
+
+#endif /* _SWAP_H_ */
@@ -37,6 +37,12 @@
 
 #include <spinlock.h>
 
+/*
+ * Set up the object cache locks come from. Call once at boot, before
+ * the first lock_create.
+ */
+void synch_bootstrap(void);
+
 /*
  * Dijkstra-style semaphore.
  *
@@ -92,12 +98,15 @@ void lock_acquire(struct lock *);
  *                   same time.
  *    lock_release - Free the lock. Only the thread holding the lock may do
  *                   this.
+ *    lock_tryacquire - Get the lock if nobody holds it, without
+ *                   sleeping. Returns true if the lock was acquired.
  *    lock_do_i_hold - Return true if the current thread holds the lock; 
  *                   false otherwise.
  *
  * These operations must be atomic. You get to write them.
  */
 void lock_release(struct lock *);
+bool lock_tryacquire(struct lock *);
 bool lock_do_i_hold(struct lock *);
 void lock_destroy(struct lock *);
 
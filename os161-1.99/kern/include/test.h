@@ -57,6 +57,7 @@ int queuetest(int, char **);
 int threadtest(int, char **);
 int threadtest2(int, char **);
 int threadtest3(int, char **);
+int threadforkbench(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
@@ -76,6 +77,9 @@ int writestress2(int, char **);
 int createstress(int, char **);
 int printfile(int, char **);
 
+/* vm tests */
+int mmaptest(int, char **);
+
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
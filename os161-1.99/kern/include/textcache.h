@@ -0,0 +1,49 @@
+#ifndef _TEXTCACHE_H_
+#define _TEXTCACHE_H_
+#include <vm.h>
+
+/*
+ * Shared text pages.
+ *
+ * Pages of read-only segments are the same in every process running
+ * a given executable, so the first process to fault one in enters
+ * the frame here, keyed by the executable's vnode and the page's user
+ * address, and later processes map the same frame instead of reading
+ * their own copy. Each mapping holds one coremap reference (see
+ * coremap_share); the entry goes away with the last of them, so the
+ * cache itself never keeps a page alive. Text frames are never made
+ * evictable.
+ *
+ * Their PTEs carry PTE_TEXT, and must be released with
+ * textcache_release rather than coremap_free.
+ */
+
+struct vnode;
+
+#define TEXTCACHE_BUCKETS  64
+
+/* Call once from vm_bootstrap. */
+void textcache_bootstrap(void);
+
+/*
+ * Return the cached frame for the page at VA of executable V with a
+ * new reference taken for the caller, or 0 if there is none.
+ */
+paddr_t textcache_lookup(struct vnode *v, vaddr_t va);
+
+/*
+ * Offer PADDR, just read in by the caller, as the frame for the page
+ * at VA of V. Returns the frame the caller should map: PADDR, or one
+ * that another process entered meanwhile, in which case PADDR has
+ * been freed. If there is no memory for the entry, PADDR is simply
+ * not cached.
+ */
+paddr_t textcache_insert(struct vnode *v, vaddr_t va, paddr_t paddr);
+
+/* Drop a mapping of text frame PADDR at VA of V. */
+void textcache_release(struct vnode *v, vaddr_t va, paddr_t paddr);
+
+/* Print entry count and hit rate (menu command "cm"). */
+void textcache_printstats(void);
+
+#endif /* _TEXTCACHE_H_ */
@@ -83,6 +83,10 @@ struct thread {
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+	unsigned t_mlfq_level;		/* Priority level; 0 is highest */
+	unsigned t_mlfq_ticks;		/* Hardclocks used at this level */
+	bool t_background;		/* Kept on the lowest level */
+	unsigned t_lastran;		/* t_cpu's c_hardclocks when last run */
 
 	/*
 	 * Interrupt state fields.
@@ -163,10 +167,21 @@ void thread_yield(void);
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Charge the current hardclock to the current thread. Returns true if
+ * it should give up the cpu. Called from the timer interrupt.
  */
-void thread_consider_migration(void);
+bool schedule_tick(void);
+
+/*
+ * Move the current thread to the lowest scheduling level for good,
+ * so that it runs only when nothing of a better level wants the cpu.
+ */
+void thread_background(void);
+
+/*
+ * Print per-cpu work stealing counts.
+ */
+void thread_printstats(void);
 
 
 #endif /* _THREAD_H_ */
@@ -9,15 +9,18 @@
 /* Virtual memory stats */
 /* Tracks stats on user programs */
 
-/* NOTE !!!!!! WARNING !!!!!
- * All of the functions (except vmstats_print) whose names begin with '_'
- * assume that atomicity is ensured elsewhere
- * (i.e., outside of these routines) by acquiring stats_lock.
- * All of the functions whose names do not begin
- * with '_' ensure atomicity locally (except vmstats_print).
+/* The counters are kept per cpu (in struct cpu), so counting takes
+ * no lock: it only turns interrupts off on the counting cpu for the
+ * increment. Reading a count sums the cpus' shares, without stopping
+ * them; a count that is still moving may be a little behind.
  *
- * Generally you will use the functions whose names
- * do not begin with '_'.
+ * Each count is also charged to the current user process, if any
+ * (except from interrupt handlers), in its p_vmstats. With the
+ * DB_VMSTAT debug flag set, sys__exit prints those.
+ *
+ * The functions whose names begin with '_' are kept for existing
+ * callers; _vmstats_inc is now the same as vmstats_inc, and
+ * _vmstats_init must be called with stats_lock held.
  */
 
 
@@ -26,6 +29,7 @@
  */
 
 /* DO NOT ADD OR CHANGE WITHOUT ALSO CHANGING vmstats.h */
+/* (cpu.h needs VMSTAT_COUNT, so keep this file free of includes) */
 #define VMSTAT_TLB_FAULT              (0)
 #define VMSTAT_TLB_FAULT_FREE         (1)
 #define VMSTAT_TLB_FAULT_REPLACE      (2)
@@ -36,7 +40,14 @@
 #define VMSTAT_ELF_FILE_READ          (7)
 #define VMSTAT_SWAP_FILE_READ         (8)
 #define VMSTAT_SWAP_FILE_WRITE        (9)
-#define VMSTAT_COUNT                 (10)
+#define VMSTAT_COW_FAULT             (10)
+#define VMSTAT_COW_AVOIDED           (11)
+#define VMSTAT_AS_ACTIVATE           (12)
+#define VMSTAT_ASID_ROLLOVER         (13)
+#define VMSTAT_SHOOTDOWN_IPI         (14)
+#define VMSTAT_SHOOTDOWN_PAGE        (15)
+#define VMSTAT_MAP_FILE_READ         (16)
+#define VMSTAT_COUNT                 (17)
 
 /* ----------------------------------------------------------------------- */
 
@@ -49,10 +60,17 @@ void _vmstats_init(void);                    /* atomicity must be ensured elsewh
  *   vmstats_inc(VMSTAT_TLB_FAULT);
  *   vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
  */
-void vmstats_inc(unsigned int index);    /* uses locking */
-void _vmstats_inc(unsigned int index);   /* atomicity must be ensured elsewhere */
+void vmstats_inc(unsigned int index);    /* lock free */
+void _vmstats_inc(unsigned int index);   /* same thing */
+
+/* Read the specified count, summed over cpus */
+unsigned int vmstats_get(unsigned int index);    /* lock free */
 
 /* Print the statistics: assumes that at least vmstats_init has been called */
 void vmstats_print(void);                    /* Does NOT use locking */
 
+/* Print the nonzero counts charged to process P (when it exits) */
+struct proc;
+void vmstats_printproc(struct proc *p);
+
 #endif /* VM_STATS_H */
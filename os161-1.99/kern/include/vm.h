@@ -59,5 +59,28 @@ void free_kpages(vaddr_t addr);
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/*
+ * Turn ASID tagging of TLB entries on or off (off flushes the TLB on
+ * every address space switch) and report TLB faults per switch since
+ * the last change. Menu command "asid".
+ */
+void vm_setasids(bool on);
+void vm_printasidstats(void);
+
+/*
+ * Stack size limit, in pages, that new processes start with. Stacks
+ * grow on demand up to it. Menu command "stack".
+ */
+void vm_setstacklimit(unsigned npages);
+unsigned vm_getstacklimit(void);
+
+/*
+ * Set how many following pages vm_fault preloads into the TLB on a
+ * miss (0 for none; capped at a small maximum) and report TLB misses
+ * since the last change. Menu command "fa".
+ */
+void vm_setfaultaround(unsigned npages);
+void vm_printfaultaround(void);
+
 
 #endif /* _VM_H_ */
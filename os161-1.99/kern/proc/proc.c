@@ -49,6 +49,7 @@
 #include <vnode.h>
 #include <vfs.h>
 #include <synch.h>
+#include <kmemcache.h>
 #include <kern/fcntl.h> 
 #include <kern/errno.h>//
 #include <kern/unistd.h>//
@@ -58,6 +59,9 @@
  */
 struct proc *kproc;
 
+/* Where proc structures come from. */
+static struct kmem_cache *proc_cache;
+
 /*
  * Mechanism for making the kernel menu thread sleep while processes are running
  */
@@ -86,13 +90,13 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(proc_cache, proc);
 		return NULL;
 	}
 
@@ -109,6 +113,10 @@ proc_create(const char *name)
 	proc->console = NULL;
 #endif // UW
 
+#if OPT_A3
+	bzero(proc->p_vmstats, sizeof(proc->p_vmstats));
+#endif /* OPT_A3 */
+
 #if OPT_A2
       // code you created or modified for ASST2 goes here
 	int counter = 2;
@@ -208,7 +216,7 @@ proc_destroy(struct proc *proc)
 	spinlock_cleanup(&proc->p_lock);
 
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(proc_cache, proc);
 
 #ifdef UW
 	/* decrement the process count */
@@ -234,6 +242,11 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+	  proc_cache = kmem_cache_create("proc", sizeof(struct proc),
+					 NULL, NULL);
+	  if (proc_cache == NULL) {
+	    panic("could not create proc cache\n");
+	  }
 	  kproc = proc_create("[kernel]");
 	  if (kproc == NULL) {
 	    panic("proc_create for kproc failed\n");
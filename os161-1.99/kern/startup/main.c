@@ -50,6 +50,10 @@
 #include <test.h>
 #include <version.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-A3.h"
+#if OPT_A3
+#include <uw-vmstats.h>
+#endif /* OPT_A3 */
 
 
 /*
@@ -107,6 +111,7 @@ boot(void)
 
 	/* Early initialization. */
 	ram_bootstrap();
+	synch_bootstrap();
 	proc_bootstrap();
 	thread_bootstrap();
 	hardclock_bootstrap();
@@ -146,6 +151,9 @@ shutdown(void)
 {
 
 	kprintf("Shutting down.\n");
+#if OPT_A3
+	vmstats_print();
+#endif /* OPT_A3 */
 	
 	vfs_clearbootfs();
 	vfs_clearcurdir();
@@ -42,9 +42,18 @@
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <kmemcache.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-A3.h"
+
+#if OPT_A3
+#include <coremap.h>
+#include <textcache.h>
+#include <vm.h>
+#include <uw-vmstats.h>
+#endif
 
 /*
  * In-kernel menu and command dispatcher.
@@ -415,6 +424,215 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_slabstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kmem_cache_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_schedstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for the kmalloc profiler; "kmprof reset" starts the counts
+ * over.
+ */
+static
+int
+cmd_kmprof(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		kmprof_reset();
+		return 0;
+	}
+	if (nargs != 1) {
+		kprintf("Usage: kmprof [reset]\n");
+		return EINVAL;
+	}
+
+	kmprof_printstats();
+
+	return 0;
+}
+
+#if OPT_A3
+static
+int
+cmd_coremapstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	coremap_printstats();
+	textcache_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for choosing the page replacement policy and comparing how
+ * the policies have done so far (e.g. run vm-mix1 under each).
+ */
+static
+int
+cmd_evict(int nargs, char **args)
+{
+	if (nargs > 2) {
+		kprintf("Usage: evict [clock|fifo|random]\n");
+		return EINVAL;
+	}
+
+	if (nargs == 2 && coremap_setpolicy(args[1])) {
+		kprintf("evict: unknown policy %s\n", args[1]);
+		return EINVAL;
+	}
+
+	coremap_printpolicies();
+
+	return 0;
+}
+
+/*
+ * Command for comparing TLB faults per context switch with and
+ * without ASID-tagged TLB entries. Switching mode starts a fresh
+ * measurement; run a workload, then "asid" alone to see the result.
+ */
+static
+int
+cmd_asid(int nargs, char **args)
+{
+	if (nargs > 2) {
+		kprintf("Usage: asid [on|off]\n");
+		return EINVAL;
+	}
+
+	if (nargs == 2) {
+		if (!strcmp(args[1], "on")) {
+			vm_setasids(true);
+		}
+		else if (!strcmp(args[1], "off")) {
+			vm_setasids(false);
+		}
+		else {
+			kprintf("Usage: asid [on|off]\n");
+			return EINVAL;
+		}
+	}
+
+	vm_printasidstats();
+
+	return 0;
+}
+
+/*
+ * Command for setting the stack limit of new processes.
+ */
+static
+int
+cmd_stacklimit(int nargs, char **args)
+{
+	int kb;
+
+	if (nargs > 2) {
+		kprintf("Usage: stack [KB]\n");
+		return EINVAL;
+	}
+
+	if (nargs == 2) {
+		kb = atoi(args[1]);
+		if (kb < PAGE_SIZE / 1024) {
+			kprintf("stack: limit must be at least %d KB\n",
+				PAGE_SIZE / 1024);
+			return EINVAL;
+		}
+		vm_setstacklimit(kb / (PAGE_SIZE / 1024));
+	}
+
+	kprintf("Stack limit for new processes: %u KB\n",
+		vm_getstacklimit() * (PAGE_SIZE / 1024));
+
+	return 0;
+}
+
+/*
+ * Command for setting how many pages vm_fault preloads into the TLB
+ * after each miss. Setting it starts a fresh measurement, as for
+ * "asid".
+ */
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	int npages;
+
+	if (nargs > 2) {
+		kprintf("Usage: fa [pages]\n");
+		return EINVAL;
+	}
+
+	if (nargs == 2) {
+		npages = atoi(args[1]);
+		if (npages < 0) {
+			kprintf("Usage: fa [pages]\n");
+			return EINVAL;
+		}
+		vm_setfaultaround(npages);
+	}
+
+	vm_printfaultaround();
+
+	return 0;
+}
+
+/*
+ * Command for printing the VM counters, summed over all cpus, and
+ * for turning the per-process report at exit on or off.
+ */
+static
+int
+cmd_vmstat(int nargs, char **args)
+{
+	if (nargs > 2) {
+		kprintf("Usage: vmstat [on|off]\n");
+		return EINVAL;
+	}
+
+	if (nargs == 2) {
+		if (!strcmp(args[1], "on")) {
+			dbflags |= DB_VMSTAT;
+		}
+		else if (!strcmp(args[1], "off")) {
+			dbflags &= ~DB_VMSTAT;
+		}
+		else {
+			kprintf("Usage: vmstat [on|off]\n");
+			return EINVAL;
+		}
+	}
+
+	vmstats_print();
+	kprintf("Per-process stats at exit %s\n",
+		(dbflags & DB_VMSTAT) ? "on" : "off");
+
+	return 0;
+}
+#endif /* OPT_A3 */
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -478,6 +696,7 @@ static const char *testmenu[] = {
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
+	"[tt4] Thread fork/exit benchmark    ",
 #if OPT_NET
 	"[net] Network test                  ",
 #endif
@@ -493,6 +712,9 @@ static const char *testmenu[] = {
 	"[fs3] FS write stress       (4)     ",
 	"[fs4] FS write stress 2     (4)     ",
 	"[fs5] FS create stress      (4)     ",
+#if OPT_A3
+	"[mm1] mmap test                     ",
+#endif
 	NULL
 };
 
@@ -524,6 +746,17 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[slab] Object cache stats           ",
+	"[kmprof] kmalloc profile [reset]    ",
+	"[sched] Work stealing stats         ",
+#if OPT_A3
+	"[cm] Coremap free lists             ",
+	"[evict] Replacement policy/stats    ",
+	"[asid] TLB faults per switch        ",
+	"[stack] Stack limit                 ",
+	"[fa] Fault-around pages             ",
+	"[vmstat] VM stats (per-process)     ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -582,6 +815,17 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "slab",       cmd_slabstats },
+	{ "kmprof",     cmd_kmprof },
+	{ "sched",      cmd_schedstats },
+#if OPT_A3
+	{ "cm",         cmd_coremapstats },
+	{ "evict",      cmd_evict },
+	{ "asid",       cmd_asid },
+	{ "stack",      cmd_stacklimit },
+	{ "fa",         cmd_faultaround },
+	{ "vmstat",     cmd_vmstat },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -594,6 +838,7 @@ static struct {
 	{ "tt1",	threadtest },
 	{ "tt2",	threadtest2 },
 	{ "tt3",	threadtest3 },
+	{ "tt4",	threadforkbench },
 	{ "sy1",	semtest },
 
 	/* synchronization assignment tests */
@@ -611,6 +856,11 @@ static struct {
 	{ "fs4",	writestress2 },
 	{ "fs5",	createstress },
 
+#if OPT_A3
+	/* virtual memory tests */
+	{ "mm1",	mmaptest },
+#endif
+
 	{ NULL, NULL }
 };
 
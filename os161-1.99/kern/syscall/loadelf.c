@@ -59,6 +59,7 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include "opt-A3.h"
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -73,6 +74,10 @@
  * executable whose load address is in kernel space. If you should
  * change this code to not use uiomove, be sure to check for this case
  * explicitly.
+ *
+ * Under A3 nothing is read here: the segment is only recorded with
+ * as_map_segment, and vm_fault reads each page in on first touch.
+ * (as_define_region does the kernel-space check.)
  */
 static
 int
@@ -93,6 +98,13 @@ load_segment(struct addrspace *as, struct vnode *v,
 	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n", 
 	      (unsigned long) filesize, (unsigned long) vaddr);
 
+#if OPT_A3
+	(void)iov;
+	(void)u;
+	(void)result;
+	(void)is_executable;
+	return as_map_segment(as, v, offset, vaddr, filesize);
+#else
 	iov.iov_ubase = (userptr_t)vaddr;
 	iov.iov_len = memsize;		 // length of the memory space
 	u.uio_iov = &iov;
@@ -143,6 +155,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 #endif
 	
 	return result;
+#endif /* OPT_A3 */
 }
 
 /*
@@ -10,6 +10,7 @@
 #include <addrspace.h>
 #include <copyinout.h>
 #include "opt-A2.h"
+#include "opt-A3.h"
 #include <synch.h>
 #include <limits.h>
 #include <mips/trapframe.h>
@@ -17,6 +18,7 @@
 #include <vfs.h>
 #include <vm.h>
 #include <test.h>
+#include <uw-vmstats.h>
 
 int sys_fork(struct trapframe *tf, pid_t *retval)
 {
@@ -120,6 +122,12 @@ void sys__exit(int exitcode) {
 
   DEBUG(DB_SYSCALL,"Syscall: _exit(%d)\n",exitcode);
 
+#if OPT_A3
+  if (dbflags & DB_VMSTAT) {
+    vmstats_printproc(p);
+  }
+#endif /* OPT_A3 */
+
   lock_acquire(lock1);
   p->quit=__WEXITED;
   p->exitcode=_MKWAIT_EXIT (exitcode);
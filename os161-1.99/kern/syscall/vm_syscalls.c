@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/unistd.h>
+#include <lib.h>
+#include <copyinout.h>
+#include <proc.h>
+#include <current.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <mips/trapframe.h>
+#include <syscall.h>
+
+/*
+ * Memory management system calls.
+ */
+
+/*
+ * sbrk: move the break of the current process by AMOUNT bytes and
+ * return the old one. sbrk(0) just reports the break, which starts
+ * out page aligned.
+ */
+int
+sys_sbrk(intptr_t amount, vaddr_t *retval)
+{
+	struct addrspace *as;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+	return as_sbrk(as, amount, retval);
+}
+
+/*
+ * mmap(addr, len, prot, flags, fd, offset). Six arguments, so fd and
+ * the 64-bit offset come from the user stack: fd at sp+16, and the
+ * offset at sp+24, the next 8-byte aligned slot.
+ */
+int
+sys_mmap(struct trapframe *tf, vaddr_t *retval)
+{
+	struct addrspace *as;
+	struct vnode *v = NULL;
+	size_t len = tf->tf_a1;
+	int prot = tf->tf_a2;
+	int flags = tf->tf_a3;
+	off_t offset;
+	int fd, result;
+
+	/* tf_a0, the address, is only a hint; it is ignored. */
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+	switch (flags & (MAP_SHARED | MAP_PRIVATE)) {
+	    case MAP_SHARED:
+	    case MAP_PRIVATE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	result = copyin((const_userptr_t)(tf->tf_sp + 24), &offset,
+			sizeof(offset));
+	if (result) {
+		return result;
+	}
+
+	if ((flags & MAP_ANON) == 0) {
+		result = copyin((const_userptr_t)(tf->tf_sp + 16), &fd,
+				sizeof(fd));
+		if (result) {
+			return result;
+		}
+		/*
+		 * There is no per-process file table yet: the console
+		 * is all a descriptor can name, as in sys_write.
+		 */
+		if (fd < STDIN_FILENO || fd > STDERR_FILENO) {
+			return EBADF;
+		}
+		v = curproc->console;
+		result = VOP_MMAP(v);
+		if (result) {
+			return result;
+		}
+	}
+	else {
+		offset = 0;
+	}
+
+	return as_mmap(as, len, prot, flags, v, offset, retval);
+}
+
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+	struct addrspace *as;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+	return as_munmap(as, (vaddr_t)addr, len);
+}
+
+/*
+ * msync(addr, len, flags). Writeback is always synchronous, so
+ * MS_ASYNC and MS_SYNC do the same thing.
+ */
+int
+sys_msync(userptr_t addr, size_t len, int flags)
+{
+	struct addrspace *as;
+
+	if ((flags & ~(MS_ASYNC | MS_SYNC | MS_INVALIDATE)) != 0 ||
+	    (flags & (MS_ASYNC | MS_SYNC)) == (MS_ASYNC | MS_SYNC)) {
+		return EINVAL;
+	}
+	as = curproc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+	return as_msync(as, (vaddr_t)addr, len);
+}
@@ -0,0 +1,249 @@
+/*
+ * mmaptest - file mapping test code
+ *
+ * Writes a file, maps it shared into a scratch address space, and
+ * checks that the mapping reads what the file holds, that msync and
+ * munmap write changes made through the mapping back to the file,
+ * and that the mapping is gone after munmap.
+ *
+ * The mapping is reached with copyin and copyout, the way system
+ * calls reach user memory, so every access goes through vm_fault.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <uio.h>
+#include <proc.h>
+#include <current.h>
+#include <copyinout.h>
+#include <addrspace.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <test.h>
+
+#define FILENAME "mmaptest.tmp"
+#define NPAGES   3
+
+static char pagebuf[PAGE_SIZE];
+
+/* The byte page PAGE of the file holds in round ROUND. */
+static
+char
+pagebyte(unsigned page, unsigned round)
+{
+	return 'A' + (page + 3 * round) % 26;
+}
+
+static
+void
+fillpage(unsigned page, unsigned round)
+{
+	unsigned i;
+
+	for (i=0; i<PAGE_SIZE; i++) {
+		pagebuf[i] = pagebyte(page, round);
+	}
+	/* so that a page shifted by a byte does not pass */
+	pagebuf[0] = '0' + page;
+}
+
+static
+int
+checkpage(const char *what, unsigned page, unsigned round)
+{
+	unsigned i;
+	char ch;
+
+	for (i=0; i<PAGE_SIZE; i++) {
+		ch = i == 0 ? '0' + page : pagebyte(page, round);
+		if (pagebuf[i] != ch) {
+			kprintf("mmaptest: %s: page %u byte %u is %d, "
+				"not %d\n", what, page, i, pagebuf[i], ch);
+			return EINVAL;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Read or write page PAGE of the file directly.
+ */
+static
+int
+filepage(struct vnode *v, unsigned page, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	uio_kinit(&iov, &ku, pagebuf, PAGE_SIZE, (off_t)page * PAGE_SIZE, rw);
+	result = rw == UIO_READ ? VOP_READ(v, &ku) : VOP_WRITE(v, &ku);
+	if (result) {
+		kprintf("mmaptest: file I/O on page %u: %s\n", page,
+			strerror(result));
+		return result;
+	}
+	if (ku.uio_resid > 0) {
+		kprintf("mmaptest: short file I/O on page %u\n", page);
+		return EIO;
+	}
+	return 0;
+}
+
+static
+int
+domaptest(struct addrspace *as, struct vnode *v)
+{
+	vaddr_t addr;
+	unsigned i;
+	int result;
+
+	for (i=0; i<NPAGES; i++) {
+		fillpage(i, 0);
+		result = filepage(v, i, UIO_WRITE);
+		if (result) {
+			return result;
+		}
+	}
+
+	result = VOP_MMAP(v);
+	if (result) {
+		kprintf("mmaptest: VOP_MMAP: %s\n", strerror(result));
+		return result;
+	}
+	result = as_mmap(as, NPAGES * PAGE_SIZE, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, v, 0, &addr);
+	if (result) {
+		kprintf("mmaptest: as_mmap: %s\n", strerror(result));
+		return result;
+	}
+
+	/* Page in from the file. */
+	for (i=0; i<NPAGES; i++) {
+		result = copyin((const_userptr_t)(addr + i * PAGE_SIZE),
+				pagebuf, PAGE_SIZE);
+		if (result) {
+			kprintf("mmaptest: copyin: %s\n", strerror(result));
+			return result;
+		}
+		result = checkpage("mapping", i, 0);
+		if (result) {
+			return result;
+		}
+	}
+
+	/* Change every page; msync writes back only the middle one. */
+	for (i=0; i<NPAGES; i++) {
+		fillpage(i, 1);
+		result = copyout(pagebuf, (userptr_t)(addr + i * PAGE_SIZE),
+				 PAGE_SIZE);
+		if (result) {
+			kprintf("mmaptest: copyout: %s\n", strerror(result));
+			return result;
+		}
+	}
+	result = as_msync(as, addr + PAGE_SIZE, PAGE_SIZE);
+	if (result) {
+		kprintf("mmaptest: as_msync: %s\n", strerror(result));
+		return result;
+	}
+	for (i=0; i<NPAGES; i++) {
+		result = filepage(v, i, UIO_READ);
+		if (result) {
+			return result;
+		}
+		result = checkpage("file after msync", i, i == 1 ? 1 : 0);
+		if (result) {
+			return result;
+		}
+	}
+
+	/* munmap writes back the rest. */
+	result = as_munmap(as, addr, NPAGES * PAGE_SIZE);
+	if (result) {
+		kprintf("mmaptest: as_munmap: %s\n", strerror(result));
+		return result;
+	}
+	for (i=0; i<NPAGES; i++) {
+		result = filepage(v, i, UIO_READ);
+		if (result) {
+			return result;
+		}
+		result = checkpage("file after munmap", i, 1);
+		if (result) {
+			return result;
+		}
+	}
+
+	result = copyin((const_userptr_t)addr, pagebuf, 1);
+	if (result != EFAULT) {
+		kprintf("mmaptest: mapping still there after munmap\n");
+		return EINVAL;
+	}
+	return 0;
+}
+
+int
+mmaptest(int nargs, char **args)
+{
+	struct addrspace *as, *oldas;
+	struct vnode *v;
+	vaddr_t sp;
+	char name[32];
+	char *device;
+	int result;
+
+	if (nargs != 2) {
+		kprintf("Usage: mm1 filesystem:\n");
+		return EINVAL;
+	}
+
+	device = args[1];
+
+	/* Allow (but do not require) colon after device name */
+	if (device[strlen(device)-1]==':') {
+		device[strlen(device)-1] = 0;
+	}
+
+	kprintf("*** Starting mmap test on %s:\n", device);
+
+	/* vfs_open destroys the string it's passed */
+	snprintf(name, sizeof(name), "%s:%s", device, FILENAME);
+	result = vfs_open(name, O_RDWR|O_CREAT|O_TRUNC, 0664, &v);
+	if (result) {
+		kprintf("Could not open %s for write: %s\n", FILENAME,
+			strerror(result));
+		return result;
+	}
+
+	as = as_create();
+	if (as == NULL) {
+		vfs_close(v);
+		return ENOMEM;
+	}
+	/* as_mmap places mappings below the stack's reach */
+	as_define_stack(as, &sp);
+	oldas = curproc_setas(as);
+	as_activate();
+
+	result = domaptest(as, v);
+
+	as_deactivate();
+	curproc_setas(oldas);
+	as_activate();
+	as_destroy(as);
+	vfs_close(v);
+
+	snprintf(name, sizeof(name), "%s:%s", device, FILENAME);
+	vfs_remove(name);
+
+	if (result) {
+		kprintf("*** Test failed\n");
+		return result;
+	}
+	kprintf("*** mmap test done\n");
+	return 0;
+}
@@ -31,7 +31,9 @@
  * Thread test code.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
 #include <thread.h>
 #include <synch.h>
 #include <test.h>
@@ -144,3 +146,62 @@ threadtest2(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Thread fork/exit benchmark: fork a thread that does nothing but
+ * exit, wait for it, and repeat; optional argument is the number of
+ * rounds. Reports the mean time per round, which is mostly
+ * thread_fork, two context switches, and thread_exit.
+ */
+
+#define FORKBENCH_ROUNDS  1000
+
+static
+void
+nullthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	V(tsem);
+}
+
+int
+threadforkbench(int nargs, char **args)
+{
+	time_t secs1, secs2, rsecs;
+	uint32_t nsecs1, nsecs2, rnsecs;
+	unsigned long usecs;
+	int i, n, result;
+
+	n = FORKBENCH_ROUNDS;
+	if (nargs > 1) {
+		n = atoi(args[1]);
+	}
+	if (n <= 0) {
+		kprintf("Usage: tt4 [rounds]\n");
+		return EINVAL;
+	}
+
+	init_sem();
+	kprintf("Starting thread fork/exit benchmark...\n");
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<n; i++) {
+		result = thread_fork("forkbench", NULL, nullthread, NULL, i);
+		if (result) {
+			kprintf("threadforkbench: thread_fork failed: %s\n",
+				strerror(result));
+			return result;
+		}
+		P(tsem);
+	}
+	gettime(&secs2, &nsecs2);
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &rsecs, &rnsecs);
+	usecs = (unsigned long)rsecs * 1000000 + rnsecs / 1000;
+	kprintf("%d rounds in %lu us: %lu us per fork and exit\n",
+		n, usecs, usecs / n);
+
+	return 0;
+}
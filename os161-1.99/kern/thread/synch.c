@@ -33,12 +33,14 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <kmemcache.h>
 
 ////////////////////////////////////////////////////////////
 //
@@ -147,37 +149,69 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * Locks come from an object cache. A free lock in the cache keeps its
+ * wait channel and spinlock, and is unheld, so lock_create only has
+ * to name it. The wait channels are all called "lock", since they
+ * outlive any one lock's name.
+ */
+static struct kmem_cache *lock_cache;
+
+static
+int
+lock_ctor(void *obj)
+{
+        struct lock *lock = obj;
+
+        lock->lk_wchan = wchan_create("lock");
+        if (lock->lk_wchan == NULL) {
+                return ENOMEM;
+        }
+        spinlock_init(&lock->lk_spinlock);
+        lock->locked = false;
+        lock->lk_holder = NULL;
+        return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+        struct lock *lock = obj;
+
+        spinlock_cleanup(&lock->lk_spinlock);
+        wchan_destroy(lock->lk_wchan);
+}
+
+void
+synch_bootstrap(void)
+{
+        lock_cache = kmem_cache_create("lock", sizeof(struct lock),
+                                       lock_ctor, lock_dtor);
+        if (lock_cache == NULL) {
+                panic("synch_bootstrap: out of memory\n");
+        }
+}
+
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
 
-        lock = kmalloc(sizeof(struct lock));
+        lock = kmem_cache_alloc(lock_cache);
         if (lock == NULL) {
                 return NULL;
         }
 
         lock->lk_name = kstrdup(name);
         if (lock->lk_name == NULL) {
-                kfree(lock);
+                kmem_cache_free(lock_cache, lock);
                 return NULL;
         }
-        
-        // add stuff here as needed
-        //Assignment 1A starts here 
-        lock->lk_wchan = wchan_create(lock->lk_name);
-        if (lock->lk_wchan == NULL) {
-            kfree(lock->lk_name);
-            kfree(lock);
-            return NULL;
-        }
-
-        spinlock_init( &lock->lk_spinlock);
 
-        lock->locked = false;
+        KASSERT(lock->locked == false);
+        KASSERT(lock->lk_holder == NULL);
 
-        lock->lk_holder = NULL;
-        
         return lock;
 }
 
@@ -188,11 +222,10 @@ lock_destroy(struct lock *lock)
 
         // add stuff here as needed
         KASSERT(lock->lk_holder == NULL);
-        spinlock_cleanup(&lock->lk_spinlock);
-        wchan_destroy(lock->lk_wchan);
-        
+        KASSERT(wchan_isempty(lock->lk_wchan));
+
         kfree(lock->lk_name);
-        kfree(lock);
+        kmem_cache_free(lock_cache, lock);
 }
 
 void
@@ -233,6 +266,24 @@ lock_release(struct lock *lock)
 //      (void)lock;  // suppress warning until code gets written
 }
 
+bool
+lock_tryacquire(struct lock *lock)
+{
+        bool acquired;
+
+        KASSERT(lock != NULL);
+
+        spinlock_acquire(&lock->lk_spinlock);
+        acquired = (lock->lk_holder == NULL);
+        if (acquired) {
+            KASSERT(lock->locked == false);
+            lock->locked = true;
+            lock->lk_holder = curthread;
+        }
+        spinlock_release(&lock->lk_spinlock);
+        return acquired;
+}
+
 bool
 lock_do_i_hold(struct lock *lock)
 {
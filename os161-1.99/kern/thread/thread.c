@@ -47,11 +47,14 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <kmemcache.h>
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <clock.h>
 
 #include "opt-synchprobs.h"
+#include "opt-A3.h"
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -72,6 +75,13 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Where thread structures come from. */
+static struct kmem_cache *thread_cache;
+
+/* Work stealing; see below. */
+static bool thread_steal(void);
+static void thread_kick_idle(struct cpu *busy);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -111,6 +121,37 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Initialize every field of a thread except its name and stack. This
+ * is used by thread_create and for threads reused from the thread
+ * cache.
+ */
+static
+void
+thread_initfields(struct thread *thread)
+{
+	thread->t_wchan_name = "NEW";
+	thread->t_state = S_READY;
+
+	/* Thread subsystem fields */
+	thread_machdep_init(&thread->t_machdep);
+	threadlistnode_init(&thread->t_listnode, thread);
+	thread->t_context = NULL;
+	thread->t_cpu = NULL;
+	thread->t_proc = NULL;
+	thread->t_mlfq_level = 0;
+	thread->t_mlfq_ticks = 0;
+	thread->t_background = false;
+	thread->t_lastran = 0;
+
+	/* Interrupt state fields */
+	thread->t_in_interrupt = false;
+	thread->t_curspl = IPL_HIGH;
+	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
+
+	/* If you add to struct thread, be sure to initialize here */
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -123,33 +164,18 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(thread_cache, thread);
 		return NULL;
 	}
-	thread->t_wchan_name = "NEW";
-	thread->t_state = S_READY;
-
-	/* Thread subsystem fields */
-	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
 	thread->t_stack = NULL;
-	thread->t_context = NULL;
-	thread->t_cpu = NULL;
-	thread->t_proc = NULL;
-
-	/* Interrupt state fields */
-	thread->t_in_interrupt = false;
-	thread->t_curspl = IPL_HIGH;
-	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
-
-	/* If you add to struct thread, be sure to initialize here */
+	thread_initfields(thread);
 
 	return thread;
 }
@@ -179,11 +205,20 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_threadcache);
 	c->c_hardclocks = 0;
+	bzero(&c->c_pagecache, sizeof(c->c_pagecache));
+	c->c_asidgen = 0;
+	c->c_tlbnext = 0;
+	c->c_faloads = 0;
+	bzero(c->c_vmstats, sizeof(c->c_vmstats));
+	bzero(&c->c_kmag, sizeof(c->c_kmag));
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
+	c->c_steals = 0;
+	c->c_migrations = 0;
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
@@ -227,6 +262,19 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+struct cpu *
+cpu_get(unsigned number)
+{
+	KASSERT(number < cpuarray_num(&allcpus));
+	return cpuarray_get(&allcpus, number);
+}
+
 /*
  * Destroy a thread.
  *
@@ -259,12 +307,82 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(thread_cache, thread);
+}
+
+/*
+ * Thread cache.
+ *
+ * Rather than destroy a zombie outright, exorcise keeps up to
+ * THREADCACHE_MAX of them per cpu, stacks and all, on c_threadcache,
+ * and thread_fork takes one from there before it goes to the
+ * allocators. That saves allocating and freeing both the thread
+ * structure and its stack for every thread, and the guard band at
+ * the bottom of the stack, checked on the way in, is still in place.
+ * Only the name is given back. Like the zombie list, the cache is
+ * used only by its own cpu with interrupts off.
+ */
+
+#define THREADCACHE_MAX  8
+
+/*
+ * Keep the zombie Z in this cpu's thread cache if there's room.
+ * Returns false if the caller should destroy it instead.
+ */
+static
+bool
+threadcache_put(struct thread *z)
+{
+	KASSERT(curthread->t_curspl > 0);
+	KASSERT(z->t_proc == NULL);
+
+	if (z->t_stack == NULL ||
+	    curcpu->c_threadcache.tl_count >= THREADCACHE_MAX) {
+		return false;
+	}
+
+	thread_checkstack(z);
+	thread_machdep_cleanup(&z->t_machdep);
+	kfree(z->t_name);
+	z->t_name = NULL;
+	z->t_wchan_name = "CACHED";
+	threadlist_addhead(&curcpu->c_threadcache, z);
+	return true;
+}
+
+/*
+ * Get a thread with a stack from this cpu's thread cache and set it up
+ * as a new thread called NAME. Returns NULL if the cache is empty (or
+ * out of memory for the name).
+ */
+static
+struct thread *
+threadcache_get(const char *name)
+{
+	struct thread *thread;
+	int spl;
+
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_threadcache);
+	splx(spl);
+
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	thread->t_name = kstrdup(name);
+	if (thread->t_name == NULL) {
+		thread_destroy(thread);
+		return NULL;
+	}
+	thread_initfields(thread);
+	return thread;
 }
 
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
- * need to have thread_destroy called on them.)
+ * need to have thread_destroy called on them.) Some are kept in the
+ * thread cache instead.
  *
  * The list of zombies is per-cpu.
  */
@@ -277,7 +395,9 @@ exorcise(void)
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		if (!threadcache_put(z)) {
+			thread_destroy(z);
+		}
 	}
 }
 
@@ -351,6 +471,12 @@ thread_bootstrap(void)
 
 	cpuarray_init(&allcpus);
 
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread),
+					 NULL, NULL);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: out of memory\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -426,6 +552,30 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Put T on the run queue of cpu C, which must be locked. The queue is
+ * kept in order of MLFQ level (see schedule() below), and T goes
+ * behind every thread of its own level or better. Searching from the
+ * tail makes the usual case, with everyone on the same level, O(1).
+ */
+static
+void
+runqueue_insert(struct cpu *c, struct thread *t)
+{
+	struct threadlistnode *tln;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (tln = c->c_runqueue.tl_tail.tln_prev; tln->tln_prev != NULL;
+	     tln = tln->tln_prev) {
+		if (tln->tln_self->t_mlfq_level <= t->t_mlfq_level) {
+			threadlist_insertafter(&c->c_runqueue, tln->tln_self, t);
+			return;
+		}
+	}
+	threadlist_addhead(&c->c_runqueue, t);
+}
+
 /*
  * Make a thread runnable.
  *
@@ -450,7 +600,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_insert(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -458,6 +608,10 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else {
+		/* It will have to wait; maybe someone else can take it. */
+		thread_kick_idle(targetcpu);
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
@@ -487,18 +641,21 @@ thread_fork(const char *name,
 	DEBUG(DB_THREADS,"Forking thread: %s\n",name);
 #endif // UW
 
-	newthread = thread_create(name);
+	newthread = threadcache_get(name);
 	if (newthread == NULL) {
-		return ENOMEM;
-	}
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
@@ -588,6 +745,14 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		thread_make_runnable(cur, true /*have lock*/);
 		break;
 	    case S_SLEEP:
+		/*
+		 * Blocking before the quantum is used up marks an
+		 * interactive or I/O-bound thread; move it up a level.
+		 */
+		if (cur->t_mlfq_level > 0 && !cur->t_background) {
+			cur->t_mlfq_level--;
+		}
+		cur->t_mlfq_ticks = 0;
 		cur->t_wchan_name = wc->wc_name;
 		/*
 		 * Add the thread to the list in the wait channel, and
@@ -613,10 +778,11 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	cur->t_state = newstate;
 
 	/*
-	 * Get the next thread. While there isn't one, call md_idle().
+	 * Get the next thread. While there isn't one, try to steal
+	 * some from another cpu, and failing that call md_idle().
 	 * curcpu->c_isidle must be true when md_idle is
-	 * called. Unlock the runqueue while idling too, to make sure
-	 * things can be added to it.
+	 * called. Unlock the runqueue while stealing and idling too,
+	 * to make sure things can be added to it.
 	 *
 	 * Note that we don't need to unlock the runqueue atomically
 	 * with idling; becoming unidle requires receiving an
@@ -635,7 +801,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (!thread_steal()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -651,6 +819,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	curcpu->c_curthread = next;
 	curthread = next;
 
+	/* For thread_cachehot. */
+	cur->t_lastran = curcpu->c_hardclocks;
+
 	/* do the switch (in assembler in switch.S) */
 	switchframe_switch(&cur->t_context, &next->t_context);
 
@@ -820,141 +991,276 @@ thread_yield(void)
 ////////////////////////////////////////////////////////////
 
 /*
- * Scheduler.
+ * Scheduler: multi-level feedback queue.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * Every thread has a level, 0 (highest priority) to MLFQ_LEVELS-1,
+ * and each cpu's run queue is kept sorted by level, round-robin
+ * within a level (see runqueue_insert). A thread runs for up to the
+ * quantum of its level, counted in hardclocks by schedule_tick; if it
+ * uses all of it, it drops a level. A thread that goes to sleep on a
+ * wait channel first, as interactive and I/O-bound threads do, moves
+ * up a level instead. So CPU hogs sink to the bottom, where they get
+ * long quanta, and the shell stays at the top, where it gets the cpu
+ * within a tick of waking up.
+ *
+ * To keep the hogs from starving behind a steady stream of higher
+ * level work, and to let a thread that stops hogging rise again,
+ * schedule() periodically puts every thread back on level 0.
+ *
+ * New threads start on level 0. Background threads, such as the page
+ * zeroing thread, stay on the lowest level whatever they do; see
+ * thread_background.
  */
 
+#define MLFQ_LEVELS  4
+
+/* Quantum at each level, in hardclocks. */
+static const unsigned mlfq_quantum[MLFQ_LEVELS] = { 1, 2, 4, 8 };
+
+/* Put everyone back on top this often; a multiple of schedule()'s. */
+#define MLFQ_BOOST_HARDCLOCKS  HZ
+
+/*
+ * This is called periodically from hardclock(). It reshuffles the
+ * current CPU's run queue by job priority.
+ */
 void
 schedule(void)
 {
+	struct threadlistnode *tln;
+	struct thread *t;
+	unsigned i, n;
+
+	if (curcpu->c_hardclocks % MLFQ_BOOST_HARDCLOCKS != 0) {
+		return;
+	}
+
 	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
+	 * Moving everyone to the same level keeps the queue sorted, and
+	 * leaves it in the order the threads would have run anyway.
+	 * Background threads stay where they are, so they go to the
+	 * back.
 	 */
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	n = curcpu->c_runqueue.tl_count;
+	tln = curcpu->c_runqueue.tl_head.tln_next;
+	for (i=0; i<n; i++) {
+		t = tln->tln_self;
+		tln = tln->tln_next;
+		if (t->t_background) {
+			threadlist_remove(&curcpu->c_runqueue, t);
+			threadlist_addtail(&curcpu->c_runqueue, t);
+			continue;
+		}
+		t->t_mlfq_level = 0;
+		t->t_mlfq_ticks = 0;
+	}
+	if (!curcpu->c_isidle && !curthread->t_background) {
+		curthread->t_mlfq_level = 0;
+		curthread->t_mlfq_ticks = 0;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+}
+
+bool
+schedule_tick(void)
+{
+	struct thread *cur, *next;
+	bool expired;
+
+	if (curcpu->c_isidle) {
+		return false;
+	}
+	cur = curthread;
+
+	cur->t_mlfq_ticks++;
+	expired = cur->t_mlfq_ticks >= mlfq_quantum[cur->t_mlfq_level];
+	if (expired) {
+		if (cur->t_mlfq_level < MLFQ_LEVELS - 1) {
+			cur->t_mlfq_level++;
+		}
+		cur->t_mlfq_ticks = 0;
+		return true;
+	}
+
+	/* Let a thread of a better level that has woken up in. */
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	next = curcpu->c_runqueue.tl_head.tln_next->tln_self;
+	expired = next != NULL && next->t_mlfq_level < cur->t_mlfq_level;
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	return expired;
+}
+
+void
+thread_background(void)
+{
+	int spl;
+
+	spl = splhigh();
+	curthread->t_background = true;
+	curthread->t_mlfq_level = MLFQ_LEVELS - 1;
+	curthread->t_mlfq_ticks = 0;
+	splx(spl);
 }
 
 /*
- * Thread migration.
+ * Work stealing.
  *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * A cpu that runs out of threads, instead of going idle, first takes
+ * some from the cpu with the most threads waiting: half of them, from
+ * the tail of its run queue (the lowest MLFQ levels, which would wait
+ * longest there), so the two end up about even. Only the victim's
+ * run queue is locked while picking, and only our own while adding;
+ * the busiest cpu is found by reading the queue lengths unlocked,
+ * which is only a hint anyway.
  *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
+ * Threads that ran on the victim within the last STEAL_HOT_HARDCLOCKS
+ * of its hardclocks still have their cache working set there, so
+ * they are left alone, unless nothing else can be taken, in which
+ * case one thread is taken anyway rather than leave the cpu idle.
+ * Migrating a thread isn't free, but System/161 does not (yet) model
+ * caches, so we err on the side of keeping cpus busy.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * An idle cpu tries again every time it wakes up. So that it does not
+ * sleep through work appearing elsewhere, making a thread runnable on
+ * a busy cpu nudges an idle one (thread_kick_idle).
  */
-void
-thread_consider_migration(void)
+
+#define STEAL_HOT_HARDCLOCKS  2
+
+/*
+ * True if T, on C's run queue, ran on C recently.
+ */
+static
+bool
+thread_cachehot(struct cpu *c, struct thread *t)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
+	return t->t_lastran != 0 &&
+		c->c_hardclocks - t->t_lastran < STEAL_HOT_HARDCLOCKS;
+}
+
+/*
+ * Move threads from the busiest other cpu to this one. Called from
+ * the idle loop in thread_switch, with interrupts off and no run
+ * queue locked. Returns true if it found any.
+ */
+static
+bool
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct threadlist stolen;
+	struct threadlistnode *tln, *prev;
 	struct thread *t;
+	unsigned i, numcpus, most, want, got;
 
-	my_count = total_count = 0;
+	victim = NULL;
+	most = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+		if (c != curcpu->c_self && c->c_runqueue.tl_count > most) {
+			most = c->c_runqueue.tl_count;
+			victim = c;
 		}
-		spinlock_release(&c->c_runqueue_lock);
+	}
+	if (victim == NULL) {
+		return false;
 	}
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
+	threadlist_init(&stolen);
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	want = DIVROUNDUP(victim->c_runqueue.tl_count, 2);
+	for (tln = victim->c_runqueue.tl_tail.tln_prev;
+	     tln->tln_prev != NULL && stolen.tl_count < want; tln = prev) {
+		prev = tln->tln_prev;
+		t = tln->tln_self;
+		/*
+		 * The victim's curthread can be on its run queue if it
+		 * went to sleep, the cpu went idle, and it was woken
+		 * again before the cpu unidled. It is still running in
+		 * thread_switch there, so it must not be taken.
+		 */
+		if (t == victim->c_curthread || thread_cachehot(victim, t)) {
+			continue;
+		}
+		threadlist_remove(&victim->c_runqueue, t);
+		threadlist_addhead(&stolen, t);
+	}
+	if (threadlist_isempty(&stolen)) {
+		/* Everything is hot; take the one at the tail. */
+		t = victim->c_runqueue.tl_tail.tln_prev->tln_self;
+		if (t != NULL && t != victim->c_curthread) {
+			threadlist_remove(&victim->c_runqueue, t);
+			threadlist_addhead(&stolen, t);
+		}
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	got = stolen.tl_count;
+	if (got == 0) {
+		threadlist_cleanup(&stolen);
+		return false;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	while ((t = threadlist_remhead(&stolen)) != NULL) {
+		t->t_cpu = curcpu->c_self;
+		/* Cold here until it has run here. */
+		t->t_lastran = 0;
+		runqueue_insert(curcpu->c_self, t);
+		DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u\n",
+		      t->t_name, victim->c_number, curcpu->c_number);
 	}
+	curcpu->c_steals++;
+	curcpu->c_migrations += got;
 	spinlock_release(&curcpu->c_runqueue_lock);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
-		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
+	threadlist_cleanup(&stolen);
+	return true;
+}
 
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
-		}
-		spinlock_release(&c->c_runqueue_lock);
-	}
+/*
+ * Wake up an idle cpu other than BUSY, if there is one, so it can
+ * steal the thread just queued on BUSY. As in thread_steal, c_isidle
+ * is read without the lock; a missed or extra nudge costs little.
+ */
+static
+void
+thread_kick_idle(struct cpu *busy)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != busy && c != curcpu->c_self && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
 		}
-		spinlock_release(&curcpu->c_runqueue_lock);
 	}
+}
+
+/*
+ * Print each cpu's steal and migration counts (menu command "sched").
+ */
+void
+thread_printstats(void)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	numcpus = cpuarray_num(&allcpus);
+	kprintf("Work stealing:\n");
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		kprintf("  cpu%u: %u steals, %u threads migrated in, "
+			"%u queued\n", c->c_number, c->c_steals,
+			c->c_migrations, c->c_runqueue.tl_count);
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -1143,17 +1449,29 @@ ipi_broadcast(int code)
 void
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
-	int n;
+	ipi_tlbshootdown_batch(target, mapping, 1);
+}
+
+void
+ipi_tlbshootdown_batch(struct cpu *target,
+		       const struct tlbshootdown *mappings, unsigned n)
+{
+	unsigned i;
+	int num;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		target->c_numshootdown = TLBSHOOTDOWN_ALL;
-	}
-	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+	for (i=0; i<n; i++) {
+		num = target->c_numshootdown;
+		if (num == TLBSHOOTDOWN_ALL) {
+			break;
+		}
+		if (num == TLBSHOOTDOWN_MAX) {
+			target->c_numshootdown = TLBSHOOTDOWN_ALL;
+			break;
+		}
+		target->c_shootdown[num] = mappings[i];
+		target->c_numshootdown = num+1;
 	}
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
@@ -1203,6 +1521,11 @@ interprocessor_interrupt(void)
 		}
 		curcpu->c_numshootdown = 0;
 	}
+#if OPT_A3
+	if (bits & (1U << IPI_PAGECACHE)) {
+		coremap_pagecache_ipi();
+	}
+#endif
 
 	curcpu->c_ipi_pending = 0;
 	spinlock_release(&curcpu->c_ipi_lock);
@@ -241,15 +241,17 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. The VM system maps files by reading and writing them a
+ * page at a time, which only block devices could support, and only
+ * at block-aligned offsets; nothing needs that yet, so no device can
+ * be mapped.
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	return ENODEV;
 }
 
 /*
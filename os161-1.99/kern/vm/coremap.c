@@ -0,0 +1,1193 @@
+/*
+ * Physical frame allocator.
+ *
+ * All RAM left over after boot is described by the coremap, an array
+ * with one struct coremap per frame that lives at the bottom of that
+ * RAM. Frames are handed out by a buddy allocator with one free list
+ * per order, so both allocation and free (including coalescing with
+ * the buddy) take O(CM_MAXORDER) steps per block no matter how much
+ * memory there is. Finding the entry for a physical address is plain
+ * index arithmetic.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <synch.h>
+#include <thread.h>
+#include <wchan.h>
+#include <vm.h>
+#include <coremap.h>
+
+static struct coremap *core_map;
+static unsigned numofframes;	/* number of entries in core_map */
+static paddr_t cm_base;		/* physical address of frame 0 */
+
+static int cm_freelist[CM_NORDERS];	/* head of free list per order */
+static unsigned cm_nfree[CM_NORDERS];	/* free blocks per order */
+static unsigned cm_freepages;		/* total free frames */
+static volatile uint8_t *cm_idle;	/* per frame; see coremap.h */
+
+/* cm_idle indexed by absolute frame number, for the refill handler. */
+vaddr_t coremap_idlebase;
+
+static int cm_evhead = CM_NONE;		/* evictable list, oldest first */
+static int cm_evtail = CM_NONE;
+static unsigned cm_nevictable;		/* frames on the evictable list */
+static int cm_hand = CM_NONE;		/* clock hand, or CM_NONE for head */
+static unsigned cm_policy = CM_POLICY_CLOCK;
+static unsigned cm_counts[CM_NPOLICIES][CM_NCOUNTS];
+static unsigned cm_refclears[CM_NPOLICIES];	/* second chances given */
+
+static int cm_zerohead = CM_NONE;	/* pre-zeroed pool, via cm_next */
+static unsigned cm_nzeroed;		/* frames in the pool */
+static unsigned cm_zerohits;		/* coremap_alloc_zeroed served */
+static unsigned cm_zeromisses;		/* ...and found the pool empty */
+static bool cm_zerowake;		/* zeroing thread has been poked */
+static struct semaphore *cm_zerosem;	/* pokes the zeroing thread */
+
+static unsigned cm_pinwaiters;		/* threads in coremap_waitpin */
+static struct wchan *cm_pinwchan;	/* ...sleep here */
+
+/* Protects everything above. */
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Emptying other cpus' page caches (see pagecache_drain_all): one
+ * round at a time, and the targets' acknowledgements.
+ */
+static struct lock *cm_drainlock;
+static struct semaphore *cm_drainsem;
+
+#define FRAME_TO_PADDR(i)   (cm_base + (paddr_t)(i) * PAGE_SIZE)
+#define PADDR_TO_FRAME(pa)  ((int)(((pa) - cm_base) / PAGE_SIZE))
+
+////////////////////////////////////////////////////////////
+//
+// Free lists
+
+static
+void
+freelist_add(int idx, unsigned order)
+{
+	int head;
+
+	KASSERT(order <= CM_MAXORDER);
+	KASSERT(idx % (1 << order) == 0);
+
+	head = cm_freelist[order];
+	core_map[idx].cm_state = CM_FREE;
+	core_map[idx].cm_order = order;
+	core_map[idx].cm_prev = CM_NONE;
+	core_map[idx].cm_next = head;
+	if (head != CM_NONE) {
+		core_map[head].cm_prev = idx;
+	}
+	cm_freelist[order] = idx;
+	cm_nfree[order]++;
+}
+
+static
+void
+freelist_remove(int idx, unsigned order)
+{
+	struct coremap *cm = &core_map[idx];
+
+	KASSERT(cm->cm_state == CM_FREE);
+	KASSERT(cm->cm_order == order);
+
+	if (cm->cm_prev != CM_NONE) {
+		core_map[cm->cm_prev].cm_next = cm->cm_next;
+	}
+	else {
+		KASSERT(cm_freelist[order] == idx);
+		cm_freelist[order] = cm->cm_next;
+	}
+	if (cm->cm_next != CM_NONE) {
+		core_map[cm->cm_next].cm_prev = cm->cm_prev;
+	}
+	cm->cm_next = cm->cm_prev = CM_NONE;
+	cm->cm_state = CM_TAIL;
+	KASSERT(cm_nfree[order] > 0);
+	cm_nfree[order]--;
+}
+
+/*
+ * Smallest order whose blocks hold NPAGES pages.
+ */
+static
+unsigned
+order_for(unsigned long npages)
+{
+	unsigned order = 0;
+
+	while ((1UL << order) < npages) {
+		order++;
+	}
+	return order;
+}
+
+/*
+ * Put the block of 2^ORDER frames at IDX on the free lists, merging
+ * it with its buddy for as long as the buddy is free too.
+ */
+static
+void
+release_block(int idx, unsigned order)
+{
+	int buddy;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	while (order < CM_MAXORDER) {
+		buddy = idx ^ (1 << order);
+		if ((unsigned)buddy >= numofframes ||
+		    core_map[buddy].cm_state != CM_FREE ||
+		    core_map[buddy].cm_order != order) {
+			break;
+		}
+		freelist_remove(buddy, order);
+		idx &= ~(1 << order);
+		order++;
+	}
+	freelist_add(idx, order);
+}
+
+/*
+ * Release NPAGES frames starting at IDX, as the largest naturally
+ * aligned blocks that fit. An exact allocation and its trimmed tail
+ * both lie inside one aligned block, so this takes at most
+ * CM_MAXORDER steps.
+ */
+static
+void
+release_range(int idx, unsigned long npages)
+{
+	unsigned order;
+
+	while (npages > 0) {
+		order = 0;
+		while (order < CM_MAXORDER &&
+		       idx % (1 << (order + 1)) == 0 &&
+		       (1UL << (order + 1)) <= npages) {
+			order++;
+		}
+		release_block(idx, order);
+		idx += 1 << order;
+		npages -= 1UL << order;
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Evictable list
+
+static
+void
+evlist_add(int idx)
+{
+	struct coremap *cm = &core_map[idx];
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(cm->cm_next == CM_NONE && cm->cm_prev == CM_NONE);
+
+	cm->cm_prev = cm_evtail;
+	if (cm_evtail != CM_NONE) {
+		core_map[cm_evtail].cm_next = idx;
+	}
+	else {
+		cm_evhead = idx;
+	}
+	cm_evtail = idx;
+	cm_nevictable++;
+}
+
+static
+void
+evlist_remove(int idx)
+{
+	struct coremap *cm = &core_map[idx];
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	if (cm_hand == idx) {
+		cm_hand = cm->cm_next;
+	}
+	if (cm->cm_prev != CM_NONE) {
+		core_map[cm->cm_prev].cm_next = cm->cm_next;
+	}
+	else {
+		KASSERT(cm_evhead == idx);
+		cm_evhead = cm->cm_next;
+	}
+	if (cm->cm_next != CM_NONE) {
+		core_map[cm->cm_next].cm_prev = cm->cm_prev;
+	}
+	else {
+		KASSERT(cm_evtail == idx);
+		cm_evtail = cm->cm_prev;
+	}
+	cm->cm_next = cm->cm_prev = CM_NONE;
+	KASSERT(cm_nevictable > 0);
+	cm_nevictable--;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+void
+coremap_bootstrap(void)
+{
+	paddr_t lo, hi;
+	unsigned long npages, cmpages;
+	unsigned i, k;
+
+	ram_getsize(&lo, &hi);
+	lo = ROUNDUP(lo, PAGE_SIZE);
+	hi &= PAGE_FRAME;
+	KASSERT(lo < hi);
+
+	/*
+	 * The coremap and the idle bytes take the first few frames.
+	 * Size them for all of RAM; the few entries this wastes are
+	 * not worth the arithmetic.
+	 */
+	npages = (hi - lo) / PAGE_SIZE;
+	cmpages = DIVROUNDUP(npages * (sizeof(struct coremap) + 1),
+			     PAGE_SIZE);
+	KASSERT(cmpages < npages);
+
+	core_map = (struct coremap *)PADDR_TO_KVADDR(lo);
+	cm_idle = (uint8_t *)&core_map[npages];
+	cm_base = lo + cmpages * PAGE_SIZE;
+	numofframes = npages - cmpages;
+	coremap_idlebase = (vaddr_t)cm_idle - cm_base / PAGE_SIZE;
+
+	for (i=0; i<numofframes; i++) {
+		core_map[i].cm_next = CM_NONE;
+		core_map[i].cm_prev = CM_NONE;
+		core_map[i].cm_state = CM_TAIL;
+		core_map[i].cm_order = 0;
+		core_map[i].cm_refcount = 0;
+		core_map[i].cm_flags = 0;
+		cm_idle[i] = 1;
+	}
+	for (k=0; k<CM_NORDERS; k++) {
+		cm_freelist[k] = CM_NONE;
+		cm_nfree[k] = 0;
+	}
+
+	/*
+	 * Carve the frames into the largest naturally aligned blocks
+	 * that fit. numofframes need not be a power of two, so the
+	 * top end comes out as a run of successively smaller blocks.
+	 */
+	i = 0;
+	while (i < numofframes) {
+		k = CM_MAXORDER;
+		while (i % (1U << k) != 0 || i + (1U << k) > numofframes) {
+			k--;
+		}
+		freelist_add(i, k);
+		i += 1U << k;
+	}
+	cm_freepages = numofframes;
+
+	kprintf("coremap: %u frames at 0x%x, %lu pages of overhead\n",
+		numofframes, cm_base, cmpages);
+}
+
+/*
+ * Take an exact NPAGES run from the buddy lists. Returns the frame
+ * index of the run, marked CM_ALLOCATED, or CM_NONE.
+ */
+static
+int
+take_run(unsigned long npages)
+{
+	unsigned order, k;
+	int idx;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	order = order_for(npages);
+	if (order > CM_MAXORDER) {
+		return CM_NONE;
+	}
+
+	for (k = order; k <= CM_MAXORDER; k++) {
+		if (cm_freelist[k] != CM_NONE) {
+			break;
+		}
+	}
+	if (k > CM_MAXORDER) {
+		return CM_NONE;
+	}
+
+	idx = cm_freelist[k];
+	freelist_remove(idx, k);
+
+	/* Split down to size, giving back the upper half each time. */
+	while (k > order) {
+		k--;
+		freelist_add(idx + (1 << k), k);
+	}
+
+	/* Keep exactly npages; the rest of the block goes back. */
+	core_map[idx].cm_state = CM_ALLOCATED;
+	core_map[idx].cm_npages = npages;
+	core_map[idx].cm_owner = NULL;
+	core_map[idx].cm_refcount = 1;
+	core_map[idx].cm_flags = 0;
+	release_range(idx + npages, (1UL << order) - npages);
+	cm_freepages -= npages;
+
+	return idx;
+}
+
+/*
+ * Give the run headed by IDX back to the buddy lists.
+ */
+static
+void
+give_run(int idx)
+{
+	struct coremap *cm = &core_map[idx];
+	unsigned npages;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(cm->cm_state == CM_ALLOCATED || cm->cm_state == CM_CACHED ||
+		cm->cm_state == CM_ZEROED);
+
+	npages = cm->cm_npages;
+	KASSERT(npages > 0);
+	KASSERT(idx + npages <= numofframes);
+
+	cm->cm_state = CM_TAIL;
+	cm->cm_owner = NULL;
+	cm->cm_npages = 0;
+	cm->cm_refcount = 0;
+	KASSERT(cm->cm_flags == 0);
+	cm_freepages += npages;
+	release_range(idx, npages);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Per-cpu page caches
+
+/*
+ * Move up to PAGECACHE_BATCH frames from the buddy lists into PC.
+ */
+static
+void
+pagecache_refill(struct pagecache *pc)
+{
+	int idx;
+
+	spinlock_acquire(&coremap_lock);
+	while (pc->pc_count < PAGECACHE_BATCH) {
+		idx = take_run(1);
+		if (idx == CM_NONE) {
+			break;
+		}
+		core_map[idx].cm_state = CM_CACHED;
+		pc->pc_frames[pc->pc_count++] = FRAME_TO_PADDR(idx);
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Move up to NFRAMES frames from PC back to the buddy lists.
+ */
+static
+void
+pagecache_drain(struct pagecache *pc, unsigned nframes)
+{
+	int idx;
+
+	spinlock_acquire(&coremap_lock);
+	while (nframes > 0 && pc->pc_count > 0) {
+		idx = PADDR_TO_FRAME(pc->pc_frames[--pc->pc_count]);
+		KASSERT(core_map[idx].cm_state == CM_CACHED);
+		give_run(idx);
+		nframes--;
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Get one frame from this cpu's cache for OWNER, refilling it if
+ * it is empty. Returns 0 only if the buddy lists are empty too.
+ */
+static
+paddr_t
+pagecache_get(struct addrspace *owner)
+{
+	struct pagecache *pc;
+	struct coremap *cm;
+	paddr_t pa;
+	int spl;
+
+	/* Interrupts off keeps us on this cpu and out of its cache. */
+	spl = splhigh();
+	pc = &curcpu->c_pagecache;
+
+	if (pc->pc_count > 0) {
+		pc->pc_allochits++;
+	}
+	else {
+		pc->pc_allocmisses++;
+		pagecache_refill(pc);
+		if (pc->pc_count == 0) {
+			splx(spl);
+			return 0;
+		}
+	}
+
+	pa = pc->pc_frames[--pc->pc_count];
+	cm = &core_map[PADDR_TO_FRAME(pa)];
+	KASSERT(cm->cm_state == CM_CACHED);
+	KASSERT(cm->cm_npages == 1);
+	cm->cm_state = CM_ALLOCATED;
+	cm->cm_owner = owner;
+	cm->cm_refcount = 1;
+
+	splx(spl);
+	return pa;
+}
+
+/*
+ * Put the single allocated frame at PA in this cpu's cache, draining
+ * a batch to the buddy lists first if the cache is full.
+ */
+static
+void
+pagecache_put(paddr_t pa)
+{
+	struct pagecache *pc;
+	struct coremap *cm;
+	int spl;
+
+	cm = &core_map[PADDR_TO_FRAME(pa)];
+	KASSERT(cm->cm_flags == 0);
+
+	spl = splhigh();
+	pc = &curcpu->c_pagecache;
+
+	if (pc->pc_count < PAGECACHE_SIZE) {
+		pc->pc_freehits++;
+	}
+	else {
+		pc->pc_freemisses++;
+		pagecache_drain(pc, PAGECACHE_BATCH);
+	}
+
+	cm->cm_state = CM_CACHED;
+	cm->cm_owner = NULL;
+	cm->cm_refcount = 0;
+	pc->pc_frames[pc->pc_count++] = pa;
+
+	splx(spl);
+}
+
+/*
+ * Have every other cpu that has frames cached give them back to the
+ * buddy lists, and wait until they have. A cache is only touched by
+ * its own cpu, so this takes an IPI to each. Returns false, having
+ * done nothing, if the caller cannot sleep.
+ */
+static
+bool
+pagecache_drain_all(void)
+{
+	struct cpu *c;
+	unsigned i, n, sent;
+	int spl;
+
+	if (cm_drainlock == NULL || curthread->t_in_interrupt ||
+	    curthread->t_curspl != 0) {
+		return false;
+	}
+
+	lock_acquire(cm_drainlock);
+
+	/* Stay on this cpu until every other one has been asked. */
+	n = cpu_count();
+	sent = 0;
+	spl = splhigh();
+	for (i=0; i<n; i++) {
+		c = cpu_get(i);
+		if (c == curcpu || c->c_pagecache.pc_count == 0) {
+			continue;
+		}
+		ipi_send(c, IPI_PAGECACHE);
+		sent++;
+	}
+	splx(spl);
+
+	while (sent > 0) {
+		P(cm_drainsem);
+		sent--;
+	}
+
+	lock_release(cm_drainlock);
+	return true;
+}
+
+void
+coremap_pagecache_ipi(void)
+{
+	pagecache_drain(&curcpu->c_pagecache, PAGECACHE_SIZE);
+	V(cm_drainsem);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Pre-zeroed pool
+
+/*
+ * Hand the whole zero pool back to the buddy lists. Returns the
+ * number of frames released.
+ */
+static
+unsigned
+zeropool_drain(void)
+{
+	unsigned n = 0;
+	int idx;
+
+	spinlock_acquire(&coremap_lock);
+	while (cm_zerohead != CM_NONE) {
+		idx = cm_zerohead;
+		KASSERT(core_map[idx].cm_state == CM_ZEROED);
+		cm_zerohead = core_map[idx].cm_next;
+		cm_nzeroed--;
+		give_run(idx);
+		n++;
+	}
+	spinlock_release(&coremap_lock);
+	return n;
+}
+
+/*
+ * Body of the zeroing thread. Each frame is taken from the buddy
+ * lists, zeroed with no lock held, and only then put in the pool;
+ * the thread yields after each one so that it mostly runs when
+ * nothing else wants the cpu.
+ */
+static
+void
+zeropool_thread(void *data1, unsigned long data2)
+{
+	int idx;
+
+	(void)data1;
+	(void)data2;
+
+	/* Zeroing is only worth the cpu nobody else wants. */
+	thread_background();
+
+	for (;;) {
+		P(cm_zerosem);
+
+		for (;;) {
+			spinlock_acquire(&coremap_lock);
+			cm_zerowake = false;
+			idx = CM_NONE;
+			if (cm_nzeroed < ZEROPOOL_HIGH &&
+			    cm_freepages > ZEROPOOL_RESERVE) {
+				idx = take_run(1);
+			}
+			spinlock_release(&coremap_lock);
+			if (idx == CM_NONE) {
+				break;
+			}
+
+			bzero((void *)PADDR_TO_KVADDR(FRAME_TO_PADDR(idx)),
+			      PAGE_SIZE);
+
+			spinlock_acquire(&coremap_lock);
+			core_map[idx].cm_state = CM_ZEROED;
+			core_map[idx].cm_next = cm_zerohead;
+			cm_zerohead = idx;
+			cm_nzeroed++;
+			spinlock_release(&coremap_lock);
+
+			thread_yield();
+		}
+	}
+}
+
+void
+coremap_zero_bootstrap(void)
+{
+	int result;
+
+	cm_zerosem = sem_create("zeropool", 0);
+	if (cm_zerosem == NULL) {
+		panic("coremap: cannot create zero pool semaphore\n");
+	}
+	cm_pinwchan = wchan_create("coremap pin");
+	if (cm_pinwchan == NULL) {
+		panic("coremap: cannot create pin wait channel\n");
+	}
+	cm_drainlock = lock_create("pagecache drain");
+	cm_drainsem = sem_create("pagecache drain", 0);
+	if (cm_drainlock == NULL || cm_drainsem == NULL) {
+		panic("coremap: cannot create page cache drain sync\n");
+	}
+	result = thread_fork("pagezero", NULL, zeropool_thread, NULL, 0);
+	if (result) {
+		panic("coremap: cannot start zeroing thread: %s\n",
+		      strerror(result));
+	}
+	cm_zerowake = true;
+	V(cm_zerosem);
+}
+
+paddr_t
+coremap_alloc_zeroed(struct addrspace *owner)
+{
+	struct coremap *cm;
+	bool wake;
+	int idx;
+
+	spinlock_acquire(&coremap_lock);
+	idx = cm_zerohead;
+	if (idx != CM_NONE) {
+		cm = &core_map[idx];
+		KASSERT(cm->cm_state == CM_ZEROED);
+		cm_zerohead = cm->cm_next;
+		cm_nzeroed--;
+		/* The pool links through cm_next; leave it as take_run would. */
+		cm->cm_next = cm->cm_prev = CM_NONE;
+		cm->cm_flags = 0;
+		cm->cm_state = CM_ALLOCATED;
+		cm->cm_owner = owner;
+		cm->cm_refcount = 1;
+		cm_zerohits++;
+	}
+	else {
+		cm_zeromisses++;
+	}
+	wake = cm_nzeroed < ZEROPOOL_LOW && !cm_zerowake &&
+		cm_zerosem != NULL;
+	if (wake) {
+		cm_zerowake = true;
+	}
+	spinlock_release(&coremap_lock);
+
+	if (wake) {
+		V(cm_zerosem);
+	}
+	return idx == CM_NONE ? 0 : FRAME_TO_PADDR(idx);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+paddr_t
+coremap_alloc(unsigned long npages, struct addrspace *owner)
+{
+	paddr_t pa;
+	int idx;
+	int spl;
+
+	KASSERT(npages > 0);
+
+	if (npages == 1) {
+		pa = pagecache_get(owner);
+		if (pa == 0 && zeropool_drain() > 0) {
+			pa = pagecache_get(owner);
+		}
+		/* Other cpus may still be sitting on free frames. */
+		if (pa == 0 && pagecache_drain_all()) {
+			pa = pagecache_get(owner);
+		}
+		return pa;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	idx = take_run(npages);
+	spinlock_release(&coremap_lock);
+
+	if (idx == CM_NONE) {
+		/*
+		 * Frames sitting in the page caches may be exactly what
+		 * is needed to make a run; give them back and retry,
+		 * starting with our own cache, which is cheap to empty.
+		 */
+		spl = splhigh();
+		pagecache_drain(&curcpu->c_pagecache, PAGECACHE_SIZE);
+		splx(spl);
+
+		spinlock_acquire(&coremap_lock);
+		idx = take_run(npages);
+		spinlock_release(&coremap_lock);
+		if (idx == CM_NONE && zeropool_drain() > 0) {
+			spinlock_acquire(&coremap_lock);
+			idx = take_run(npages);
+			spinlock_release(&coremap_lock);
+		}
+		if (idx == CM_NONE && pagecache_drain_all()) {
+			spinlock_acquire(&coremap_lock);
+			idx = take_run(npages);
+			spinlock_release(&coremap_lock);
+		}
+		if (idx == CM_NONE) {
+			return 0;
+		}
+	}
+
+	core_map[idx].cm_owner = owner;
+	return FRAME_TO_PADDR(idx);
+}
+
+/*
+ * Wait until the frame CM is not pinned. Called, and returns, with
+ * coremap_lock held. The pageout code keeps its pin while it writes
+ * the page out, so sleep until coremap_unpin if we are allowed to;
+ * spin otherwise.
+ */
+static
+void
+coremap_waitpin(struct coremap *cm)
+{
+	while (cm->cm_flags & CM_PINNED) {
+		if (cm_pinwchan == NULL || curthread->t_in_interrupt ||
+		    curthread->t_iplhigh_count > 1) {
+			/* Other locks held, or interrupts off. */
+			spinlock_release(&coremap_lock);
+			spinlock_acquire(&coremap_lock);
+			continue;
+		}
+		cm_pinwaiters++;
+		wchan_lock(cm_pinwchan);
+		spinlock_release(&coremap_lock);
+		wchan_sleep(cm_pinwchan);
+		spinlock_acquire(&coremap_lock);
+		cm_pinwaiters--;
+	}
+}
+
+void
+coremap_free(paddr_t paddr)
+{
+	struct coremap *cm;
+	int idx;
+
+	if (paddr < cm_base) {
+		/*
+		 * Stolen with ram_stealmem before vm_bootstrap, or
+		 * the coremap itself. Not ours to give back.
+		 */
+		return;
+	}
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+	idx = PADDR_TO_FRAME(paddr);
+	KASSERT((unsigned)idx < numofframes);
+	cm = &core_map[idx];
+
+	/*
+	 * Nobody else touches the head of a block we own, so this
+	 * check is safe without the lock.
+	 */
+	if (cm->cm_state != CM_ALLOCATED) {
+		panic("coremap_free: 0x%x is not an allocated block\n",
+		      paddr);
+	}
+
+	/*
+	 * A shared frame goes back only with its last reference. A
+	 * count of 1 can only be seen by the sole holder, and nobody
+	 * can raise it behind that holder's back, so the common case
+	 * stays off the lock.
+	 */
+	if (cm->cm_refcount > 1) {
+		spinlock_acquire(&coremap_lock);
+		if (cm->cm_refcount > 1) {
+			cm->cm_refcount--;
+			spinlock_release(&coremap_lock);
+			return;
+		}
+		spinlock_release(&coremap_lock);
+	}
+
+	if (cm->cm_flags != 0) {
+		/*
+		 * Withdraw a user frame from eviction, once the pageout
+		 * code has let go of it.
+		 */
+		spinlock_acquire(&coremap_lock);
+		coremap_waitpin(cm);
+		if (cm->cm_flags & CM_EVICTABLE) {
+			evlist_remove(idx);
+		}
+		cm->cm_flags = 0;
+		spinlock_release(&coremap_lock);
+	}
+
+	if (cm->cm_npages == 1) {
+		pagecache_put(paddr);
+		return;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	give_run(idx);
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_share(paddr_t paddr)
+{
+	struct coremap *cm;
+	int idx;
+
+	KASSERT(paddr >= cm_base);
+	idx = PADDR_TO_FRAME(paddr);
+	cm = &core_map[idx];
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(cm->cm_state == CM_ALLOCATED);
+	KASSERT(cm->cm_npages == 1);
+	KASSERT(cm->cm_refcount < 0xffff);
+	/* Same wait as in coremap_free. */
+	coremap_waitpin(cm);
+	cm->cm_refcount++;
+	/* No single owner to evict it from any more. */
+	if (cm->cm_flags & CM_EVICTABLE) {
+		evlist_remove(idx);
+		cm->cm_flags &= ~CM_EVICTABLE;
+	}
+	spinlock_release(&coremap_lock);
+}
+
+unsigned
+coremap_refcount(paddr_t paddr)
+{
+	KASSERT(paddr >= cm_base);
+	return core_map[PADDR_TO_FRAME(paddr)].cm_refcount;
+}
+
+void
+coremap_map(paddr_t paddr, struct addrspace *owner, vaddr_t vaddr)
+{
+	struct coremap *cm;
+	int idx;
+
+	KASSERT(paddr >= cm_base);
+	KASSERT(owner != NULL);
+	idx = PADDR_TO_FRAME(paddr);
+	cm = &core_map[idx];
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(cm->cm_state == CM_ALLOCATED);
+	KASSERT(cm->cm_npages == 1);
+	KASSERT(cm->cm_refcount == 1);
+	KASSERT((cm->cm_flags & CM_PINNED) == 0);
+	cm->cm_owner = owner;
+	cm->cm_vaddr = vaddr;
+	cm_idle[idx] = 0;
+	if ((cm->cm_flags & CM_EVICTABLE) == 0) {
+		cm->cm_flags |= CM_EVICTABLE;
+		evlist_add(idx);
+	}
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_touch(paddr_t paddr)
+{
+	KASSERT(paddr >= cm_base);
+	cm_idle[PADDR_TO_FRAME(paddr)] = 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Replacement policies
+//
+// Each returns the index of an unpinned evictable frame, or CM_NONE,
+// with the coremap lock held.
+
+/*
+ * Second chance: sweep the hand round the evictable list, clearing
+ * reference bits, and take the first frame found with its bit clear.
+ */
+static
+int
+victim_clock(struct cm_sweep *sweep)
+{
+	struct coremap *cm;
+	unsigned n;
+	int idx;
+
+	/* Two turns: the second finds the bits the first cleared. */
+	for (n=0; n<2 * cm_nevictable; n++) {
+		if (cm_hand == CM_NONE) {
+			cm_hand = cm_evhead;
+		}
+		idx = cm_hand;
+		cm = &core_map[idx];
+		cm_hand = cm->cm_next;
+
+		if (cm->cm_flags & CM_PINNED) {
+			continue;
+		}
+		if (sweep != NULL && !cm_idle[idx]) {
+			cm_idle[idx] = 1;
+			cm_refclears[cm_policy]++;
+			sweep->cs_vaddr[sweep->cs_count++] = cm->cm_vaddr;
+			if (sweep->cs_count == CM_SWEEPMAX) {
+				break;
+			}
+			continue;
+		}
+		return idx;
+	}
+	return CM_NONE;
+}
+
+/*
+ * Oldest first.
+ */
+static
+int
+victim_fifo(struct cm_sweep *sweep)
+{
+	int idx;
+
+	(void)sweep;
+	for (idx = cm_evhead; idx != CM_NONE; idx = core_map[idx].cm_next) {
+		if ((core_map[idx].cm_flags & CM_PINNED) == 0) {
+			return idx;
+		}
+	}
+	return CM_NONE;
+}
+
+/*
+ * The first evictable frame at or after a random one.
+ */
+static
+int
+victim_random(struct cm_sweep *sweep)
+{
+	unsigned n, idx;
+
+	(void)sweep;
+	if (cm_nevictable == 0) {
+		return CM_NONE;
+	}
+	idx = random() % numofframes;
+	for (n=0; n<numofframes; n++) {
+		if (core_map[idx].cm_state == CM_ALLOCATED &&
+		    core_map[idx].cm_flags == CM_EVICTABLE) {
+			return idx;
+		}
+		idx = (idx + 1) % numofframes;
+	}
+	return CM_NONE;
+}
+
+static const struct {
+	const char *name;
+	int (*victim)(struct cm_sweep *sweep);
+} cm_policies[CM_NPOLICIES] = {
+	[CM_POLICY_CLOCK] =  { "clock",  victim_clock },
+	[CM_POLICY_FIFO] =   { "fifo",   victim_fifo },
+	[CM_POLICY_RANDOM] = { "random", victim_random },
+};
+
+paddr_t
+coremap_pin_victim(struct addrspace **owner, vaddr_t *vaddr,
+		   struct cm_sweep *sweep)
+{
+	struct coremap *cm;
+	paddr_t pa = 0;
+	int idx;
+
+	if (sweep != NULL) {
+		sweep->cs_count = 0;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	idx = cm_policies[cm_policy].victim(sweep);
+	if (idx != CM_NONE) {
+		cm = &core_map[idx];
+		KASSERT(cm->cm_state == CM_ALLOCATED);
+		KASSERT(cm->cm_flags == CM_EVICTABLE);
+		KASSERT(cm->cm_refcount == 1);
+		cm->cm_flags |= CM_PINNED;
+		*owner = cm->cm_owner;
+		*vaddr = cm->cm_vaddr;
+		pa = FRAME_TO_PADDR(idx);
+	}
+	spinlock_release(&coremap_lock);
+	return pa;
+}
+
+void
+coremap_unpin(paddr_t paddr)
+{
+	struct coremap *cm;
+	bool wake;
+
+	KASSERT(paddr >= cm_base);
+	cm = &core_map[PADDR_TO_FRAME(paddr)];
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(cm->cm_flags & CM_PINNED);
+	cm->cm_flags &= ~CM_PINNED;
+	wake = cm_pinwaiters > 0;
+	spinlock_release(&coremap_lock);
+
+	if (wake) {
+		wchan_wakeall(cm_pinwchan);
+	}
+}
+
+int
+coremap_setpolicy(const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<CM_NPOLICIES; i++) {
+		if (!strcmp(name, cm_policies[i].name)) {
+			spinlock_acquire(&coremap_lock);
+			cm_policy = i;
+			spinlock_release(&coremap_lock);
+			return 0;
+		}
+	}
+	return EINVAL;
+}
+
+void
+coremap_count(unsigned what)
+{
+	KASSERT(what < CM_NCOUNTS);
+
+	spinlock_acquire(&coremap_lock);
+	cm_counts[cm_policy][what]++;
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_printstats(void)
+{
+	unsigned nfree[CM_NORDERS];
+	unsigned freepages, kpages, upages, k, i;
+	unsigned allocs, frees;
+	unsigned nzeroed, zerohits, zeromisses;
+	struct pagecache *pc;
+
+	/* Snapshot under the lock; kprintf may sleep. */
+	spinlock_acquire(&coremap_lock);
+	for (k=0; k<CM_NORDERS; k++) {
+		nfree[k] = cm_nfree[k];
+	}
+	freepages = cm_freepages;
+	nzeroed = cm_nzeroed;
+	zerohits = cm_zerohits;
+	zeromisses = cm_zeromisses;
+
+	/* Walk block by block, not frame by frame. */
+	kpages = upages = 0;
+	i = 0;
+	while (i < numofframes) {
+		switch (core_map[i].cm_state) {
+		    case CM_FREE:
+			i += 1U << core_map[i].cm_order;
+			break;
+		    case CM_CACHED:
+		    case CM_ZEROED:
+			i++;
+			break;
+		    case CM_ALLOCATED:
+			if (core_map[i].cm_owner == NULL) {
+				kpages += core_map[i].cm_npages;
+			}
+			else {
+				upages += core_map[i].cm_npages;
+			}
+			i += core_map[i].cm_npages;
+			break;
+		    default:
+			panic("coremap: frame %u is not a block head\n", i);
+		}
+	}
+	spinlock_release(&coremap_lock);
+
+	kprintf("Coremap: %u of %u frames free, %u kernel, %u user\n",
+		freepages, numofframes, kpages, upages);
+	kprintf("  order     pages  free blocks  free pages\n");
+	for (k=0; k<CM_NORDERS; k++) {
+		kprintf("  %5u  %8u  %11u  %10u\n",
+			k, 1U << k, nfree[k], nfree[k] << k);
+	}
+
+	/* Other cpus' counters are read racily; fine for stats. */
+	kprintf("Pagecache:\n");
+	kprintf("  cpu  cached  alloc hit/miss     %%  free hit/miss     %%\n");
+	for (i=0; i<cpu_count(); i++) {
+		pc = &cpu_get(i)->c_pagecache;
+		allocs = pc->pc_allochits + pc->pc_allocmisses;
+		frees = pc->pc_freehits + pc->pc_freemisses;
+		kprintf("  %3u  %6u  %7u/%-7u  %3u  %6u/%-6u  %3u\n",
+			i, pc->pc_count,
+			pc->pc_allochits, pc->pc_allocmisses,
+			allocs ? pc->pc_allochits * 100 / allocs : 0,
+			pc->pc_freehits, pc->pc_freemisses,
+			frees ? pc->pc_freehits * 100 / frees : 0);
+	}
+
+	allocs = zerohits + zeromisses;
+	kprintf("Zero pool: %u frames, %u/%u hit/miss (%u%%)\n",
+		nzeroed, zerohits, zeromisses,
+		allocs ? zerohits * 100 / allocs : 0);
+}
+
+void
+coremap_printpolicies(void)
+{
+	unsigned counts[CM_NPOLICIES][CM_NCOUNTS];
+	unsigned refclears[CM_NPOLICIES];
+	unsigned policy, faults, swapins, evictions, i, j;
+
+	spinlock_acquire(&coremap_lock);
+	for (i=0; i<CM_NPOLICIES; i++) {
+		for (j=0; j<CM_NCOUNTS; j++) {
+			counts[i][j] = cm_counts[i][j];
+		}
+		refclears[i] = cm_refclears[i];
+	}
+	policy = cm_policy;
+	spinlock_release(&coremap_lock);
+
+	/*
+	 * Refaults are pages read back from swap: the smaller their
+	 * share of the evictions, the better the policy chose.
+	 */
+	kprintf("Replacement policy: %s\n", cm_policies[policy].name);
+	kprintf("  policy    faults  swap-ins     %%  evictions  refault %%"
+		"  2nd chances\n");
+	for (i=0; i<CM_NPOLICIES; i++) {
+		faults = counts[i][CM_COUNT_FAULT];
+		swapins = counts[i][CM_COUNT_SWAPIN];
+		evictions = counts[i][CM_COUNT_EVICT];
+		kprintf("  %-6s  %8u  %8u  %3u  %9u  %9u  %11u\n",
+			cm_policies[i].name, faults, swapins,
+			faults ? swapins * 100 / faults : 0,
+			evictions,
+			evictions ? swapins * 100 / evictions : 0,
+			refclears[i]);
+	}
+}
@@ -30,7 +30,12 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <mainbus.h>
 #include <vm.h>
+#include "opt-kmprof.h"
 
 /*
  * Kernel malloc.
@@ -118,84 +123,171 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
- *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
- *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * Pagerefs are carved out of whole pages from alloc_kpages, one page
+ * at a time as more are needed; a page of them covers 1M of heap.
+ * Unused pagerefs sit on pageref_freelist, chained through next_all.
+ * Pages of pagerefs are never given back: even a large heap needs
+ * only a few of them.
+ */
+
+#define PAGEREFS_PER_PAGE (PAGE_SIZE / sizeof(struct pageref))
+
+static struct pageref *pageref_freelist;
+static unsigned npagerefpages;		/* pages of pagerefs we have */
+static unsigned npagerefs_inuse;	/* pagerefs not on the freelist */
+
+////////////////////////////////////////
+
+static struct pageref *sizebases[NSIZES];
+static struct pageref *allbase;
+
+////////////////////////////////////////
+
+/*
+ * Use one spinlock for the whole thing. Making parts of the kmalloc
+ * logic per-cpu is worthwhile for scalability; however, for the time
+ * being at least we won't, because it adds a lot of complexity and in
+ * OS/161 performance and scalability aren't super-critical.
  */
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
+static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+////////////////////////////////////////
 
+/*
+ * The pageref of every page, for kfree.
+ *
+ * kfree has to find a block's pageref, and before it can put the
+ * block in a magazine (see below) its size, without taking the lock
+ * or searching. So we keep a pageref pointer for each page of RAM,
+ * indexed by physical page number: NULL for a page that is not ours.
+ * It is set when a page joins the subpage allocator and cleared when
+ * it leaves, both under kmalloc_spinlock. A page with a block still
+ * allocated (or sitting in a magazine) cannot leave, so kfree may
+ * read the entry for such a block, and its pageref's page address and
+ * block type, without the lock.
+ */
+static struct pageref **pagerefmap;
+static unsigned npagerefmap;
+
+/*
+ * Set up pagerefmap[]. Called on every subpage_kmalloc, but only does
+ * anything the first time, which is early in boot when there is only
+ * one thread.
+ */
 static
-struct pageref *
-allocpageref(void)
+void
+pagerefmap_init(void)
 {
-	unsigned i,j;
-	uint32_t k;
+	unsigned npages;
+	size_t size;
+	vaddr_t map;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
-			continue;
-		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
-			}
-		}
-		KASSERT(0);
+	if (pagerefmap != NULL) {
+		return;
 	}
 
-	/* ran out */
-	return NULL;
+	npages = mainbus_ramsize() / PAGE_SIZE;
+	size = npages * sizeof(struct pageref *);
+	map = alloc_kpages(DIVROUNDUP(size, PAGE_SIZE));
+	if (map == 0) {
+		panic("kmalloc: no memory for the pageref map\n");
+	}
+	bzero((void *)map, size);
+	npagerefmap = npages;
+	pagerefmap = (struct pageref **)map;
 }
 
 static
 void
-freepageref(struct pageref *p)
+pagerefmap_set(vaddr_t page, struct pageref *pr)
 {
-	size_t i, j;
-	uint32_t k;
+	unsigned pn;
 
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
-	i = j/32;
-	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	pn = K_TO_P(page) / PAGE_SIZE;
+	KASSERT(pn < npagerefmap);
+	pagerefmap[pn] = pr;
 }
 
-////////////////////////////////////////
+/*
+ * Pageref of the page holding PTR, or NULL if PTR is not on a subpage
+ * page.
+ */
+static
+struct pageref *
+pagerefmap_get(vaddr_t ptr)
+{
+	unsigned pn;
 
-static struct pageref *sizebases[NSIZES];
-static struct pageref *allbase;
+	if (ptr < MIPS_KSEG0 || ptr >= MIPS_KSEG1) {
+		return NULL;
+	}
+	pn = K_TO_P(ptr) / PAGE_SIZE;
+	if (pn >= npagerefmap) {
+		return NULL;
+	}
+	return pagerefmap[pn];
+}
 
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Get a pageref, or NULL if the freelist is empty, in which case the
+ * caller should drop the lock, get a page, and pass it to
+ * pagerefs_addpage.
  */
+static
+struct pageref *
+allocpageref(void)
+{
+	struct pageref *pr;
 
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	pr = pageref_freelist;
+	if (pr != NULL) {
+		pageref_freelist = pr->next_all;
+		npagerefs_inuse++;
+	}
+	return pr;
+}
+
+static
+void
+freepageref(struct pageref *pr)
+{
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(npagerefs_inuse > 0);
+
+	pr->pageaddr_and_blocktype = 0;
+	pr->next_samesize = NULL;
+	pr->next_all = pageref_freelist;
+	pageref_freelist = pr;
+	npagerefs_inuse--;
+}
+
+/*
+ * Add the page at REFPAGE to the pagerefs.
+ */
+static
+void
+pagerefs_addpage(vaddr_t refpage)
+{
+	struct pageref *prs;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prs = (struct pageref *)refpage;
+	for (i=0; i<PAGEREFS_PER_PAGE; i++) {
+		prs[i].next_samesize = NULL;
+		prs[i].pageaddr_and_blocktype = 0;
+		prs[i].next_all = pageref_freelist;
+		pageref_freelist = &prs[i];
+	}
+	npagerefpages++;
+}
 
 ////////////////////////////////////////
 
@@ -260,18 +352,20 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(sc < npagerefs_inuse);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+		KASSERT(pagerefmap_get(PR_PAGEADDR(pr)) == pr);
+		KASSERT(ac < npagerefs_inuse);
 		ac++;
 	}
 
 	KASSERT(sc==ac);
+	KASSERT(ac==npagerefs_inuse);
 }
 #else
 #define checksubpages() 
@@ -330,15 +424,20 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
+static void kmag_printstats(void);
+
 void
 kheap_printstats(void)
 {
 	struct pageref *pr;
 
+	kmag_printstats();
+
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
-	kprintf("Subpage allocator status:\n");
+	kprintf("Subpage allocator status (%u pages, %u pages of pagerefs):\n",
+		npagerefs_inuse, npagerefpages);
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		dumpsubpage(pr);
@@ -392,26 +491,21 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Take one free block of type BLKTYPE from the pages we already have,
+ * or return NULL if none of them has one. Called with the lock held.
+ */
 static
 void *
-subpage_kmalloc(size_t sz)
+subpage_take(unsigned blktype)
 {
-	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
-	struct freelist *volatile fl;	// free list entry
+	struct freelist *fl;	// free list entry
 	void *retptr;		// our result
 
-	volatile int i;
-
-
-	blktype = blocktype(sz);
-	sz = sizes[blktype];
-
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
 
@@ -420,9 +514,6 @@ subpage_kmalloc(size_t sz)
 		checksubpage(pr);
 
 		if (pr->nfree > 0) {
-
-		doalloc: /* comes here after getting a whole fresh page */
-
 			KASSERT(pr->freelist_offset < PAGE_SIZE);
 			prpage = PR_PAGEADDR(pr);
 			fla = prpage + pr->freelist_offset;
@@ -443,13 +534,44 @@ subpage_kmalloc(size_t sz)
 				pr->freelist_offset = INVALID_OFFSET;
 			}
 
-			checksubpages();
-
-			spinlock_release(&kmalloc_spinlock);
 			return retptr;
 		}
 	}
 
+	return NULL;
+}
+
+static
+void *
+subpage_kmalloc(size_t sz)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	struct pageref *pr;	// pageref for page we're allocating from
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t refpage;	// new page of pagerefs
+	vaddr_t fla;		// free list entry address
+	struct freelist *volatile fl;	// free list entry
+	void *retptr;		// our result
+
+	volatile int i;
+
+
+	blktype = blocktype(sz);
+	sz = sizes[blktype];
+
+	pagerefmap_init();
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	retptr = subpage_take(blktype);
+	if (retptr != NULL) {
+		checksubpages();
+		spinlock_release(&kmalloc_spinlock);
+		return retptr;
+	}
+
 	/*
 	 * No page of the right size available.
 	 * Make a new one.
@@ -468,13 +590,18 @@ subpage_kmalloc(size_t sz)
 	}
 	spinlock_acquire(&kmalloc_spinlock);
 
-	pr = allocpageref();
-	if (pr==NULL) {
-		/* Couldn't allocate accounting space for the new page. */
+	while ((pr = allocpageref()) == NULL) {
+		/* Need another page of pagerefs; same drill. */
 		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
-		return NULL;
+		refpage = alloc_kpages(1);
+		if (refpage==0) {
+			free_kpages(prpage);
+			kprintf("kmalloc: Subpage allocator couldn't get "
+				"pageref\n");
+			return NULL;
+		}
+		spinlock_acquire(&kmalloc_spinlock);
+		pagerefs_addpage(refpage);
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
@@ -504,13 +631,28 @@ subpage_kmalloc(size_t sz)
 	pr->next_all = allbase;
 	allbase = pr;
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	pagerefmap_set(prpage, pr);
+
+	/* Someone may have freed a block meanwhile; any will do. */
+	retptr = subpage_take(blktype);
+	KASSERT(retptr != NULL);
+
+	checksubpages();
+
+	spinlock_release(&kmalloc_spinlock);
+	return retptr;
 }
 
+/*
+ * Put the block at PTR back on its page's free list. Returns -1 if
+ * PTR is not on any of our pages. If that leaves the page wholly
+ * free, the page leaves the subpage allocator and is handed back in
+ * FREEPAGE, for the caller to free_kpages once it has dropped the
+ * lock; otherwise FREEPAGE is set to 0. Called with the lock held.
+ */
 static
 int
-subpage_kfree(void *ptr)
+subpage_put(void *ptr, vaddr_t *freepage)
 {
 	int blktype;		// index into sizes[] that we're using
 	vaddr_t ptraddr;	// same as ptr
@@ -520,31 +662,25 @@ subpage_kfree(void *ptr)
 	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
 
-	ptraddr = (vaddr_t)ptr;
-
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
+	ptraddr = (vaddr_t)ptr;
+	*freepage = 0;
 
+	pr = pagerefmap_get(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	KASSERT(ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE);
+	checksubpage(pr);
+
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -577,13 +713,31 @@ subpage_kfree(void *ptr)
 	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
+		pagerefmap_set(prpage, NULL);
 		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+		*freepage = prpage;
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+
+	return 0;
+}
+
+static
+int
+subpage_kfree(void *ptr)
+{
+	vaddr_t freepage;
+	int result;
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	result = subpage_put(ptr, &freepage);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	spinlock_release(&kmalloc_spinlock);
+	if (freepage != 0) {
+		free_kpages(freepage);
 	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
@@ -592,15 +746,692 @@ subpage_kfree(void *ptr)
 	spinlock_release(&kmalloc_spinlock);
 #endif
 
-	return 0;
+	return result;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+// Each cpu has two magazines of free blocks for each block size with
+// a nonzero kmag_rounds[] (struct kmagcpu, in struct cpu): the loaded
+// one, which kmalloc takes from and kfree adds to, and the previous
+// one. When the loaded magazine runs empty (on alloc) or full (on
+// free) and the previous one can take its place, the two are swapped.
+// Otherwise a full magazine is fetched from or handed to the depot, a
+// small global stash of full magazines per size with its own lock,
+// and only if the depot can't help does the cpu go to the pages
+// under kmalloc_spinlock, a magazine's worth of blocks at a time. So
+// the common case takes no lock at all, just interrupts off to stay
+// on the cpu; and a cpu that alternates allocs and frees around a
+// magazine boundary does not go to the depot each time.
+//
+// Blocks in magazines count as allocated as far as the pages are
+// concerned, so kheap_printstats shows them as in use.
+//
+
+/*
+ * Assumes the MIPS/sys161 page size; see sizes[] above.
+ */
+#if NSIZES != KMAG_NSIZES
+#error "KMAG_NSIZES in cpu.h must match NSIZES"
+#endif
+
+/*
+ * Rounds per magazine for each block size: at most KMAG_ROUNDS, and
+ * no more than 1K of blocks. The two largest sizes aren't cached;
+ * they are rarely used and would tie up too much memory per cpu.
+ */
+static const unsigned kmag_rounds[NSIZES] = { 16, 16, 16, 8, 4, 2, 0, 0 };
+
+#define KMAG_DEPOT 4
+static struct kmag kmag_depot[NSIZES][KMAG_DEPOT];
+static unsigned kmag_ndepot[NSIZES];
+static struct spinlock kmag_depot_lock = SPINLOCK_INITIALIZER;
+
+static
+void
+kmag_swap(struct kmag *a, struct kmag *b)
+{
+	struct kmag tmp;
+
+	tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+/*
+ * Replace the empty magazine MAG with a full one from the depot, if
+ * there is one. Returns true if it did.
+ */
+static
+bool
+kmag_depot_get(unsigned blktype, struct kmag *mag)
+{
+	bool got = false;
+
+	KASSERT(mag->km_count == 0);
+
+	spinlock_acquire(&kmag_depot_lock);
+	if (kmag_ndepot[blktype] > 0) {
+		*mag = kmag_depot[blktype][--kmag_ndepot[blktype]];
+		got = true;
+	}
+	spinlock_release(&kmag_depot_lock);
+	return got;
+}
+
+/*
+ * Hand the full magazine MAG to the depot, leaving MAG empty, if the
+ * depot has room. Returns true if it did.
+ */
+static
+bool
+kmag_depot_put(unsigned blktype, struct kmag *mag)
+{
+	bool put = false;
+
+	KASSERT(mag->km_count == kmag_rounds[blktype]);
+
+	spinlock_acquire(&kmag_depot_lock);
+	if (kmag_ndepot[blktype] < KMAG_DEPOT) {
+		kmag_depot[blktype][kmag_ndepot[blktype]++] = *mag;
+		mag->km_count = 0;
+		put = true;
+	}
+	spinlock_release(&kmag_depot_lock);
+	return put;
+}
+
+/*
+ * Load the empty magazine MAG with blocks from pages we already have.
+ * It may stay empty; getting a new page is left to subpage_kmalloc,
+ * which need not run with interrupts off.
+ */
+static
+void
+kmag_fill(unsigned blktype, struct kmag *mag)
+{
+	void *ptr;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	while (mag->km_count < kmag_rounds[blktype]) {
+		ptr = subpage_take(blktype);
+		if (ptr == NULL) {
+			break;
+		}
+		mag->km_blocks[mag->km_count++] = ptr;
+	}
+	spinlock_release(&kmalloc_spinlock);
+}
+
+/*
+ * Empty the magazine MAG back onto the pages. Pages that become free
+ * are stored in FREEPAGES (which needs room for a magazine's worth),
+ * for the caller to free_kpages later; returns how many there are.
+ */
+static
+unsigned
+kmag_drain(struct kmag *mag, vaddr_t *freepages)
+{
+	unsigned n = 0;
+	int result;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	while (mag->km_count > 0) {
+		result = subpage_put(mag->km_blocks[--mag->km_count],
+				     &freepages[n]);
+		KASSERT(result == 0);
+		if (freepages[n] != 0) {
+			n++;
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+	return n;
+}
+
+/*
+ * Get a block of type BLKTYPE from this cpu's magazines, or NULL if
+ * they, the depot and our pages have none.
+ */
+static
+void *
+kmag_alloc(unsigned blktype)
+{
+	struct kmagcpu *kmc;
+	struct kmag *loaded, *previous;
+	void *ptr;
+	int spl;
+
+	if (kmag_rounds[blktype] == 0 || !CURCPU_EXISTS()) {
+		return NULL;
+	}
+
+	/* Interrupts off keeps us on this cpu and out of its magazines. */
+	spl = splhigh();
+	kmc = &curcpu->c_kmag;
+	loaded = &kmc->kmc_loaded[blktype];
+	previous = &kmc->kmc_previous[blktype];
+
+	if (loaded->km_count > 0) {
+		kmc->kmc_allochits++;
+	}
+	else if (previous->km_count > 0) {
+		kmag_swap(loaded, previous);
+		kmc->kmc_allochits++;
+	}
+	else {
+		kmc->kmc_allocmisses++;
+		if (!kmag_depot_get(blktype, loaded)) {
+			kmag_fill(blktype, loaded);
+		}
+	}
+
+	ptr = NULL;
+	if (loaded->km_count > 0) {
+		ptr = loaded->km_blocks[--loaded->km_count];
+	}
+	splx(spl);
+
+	return ptr;
+}
+
+/*
+ * Give the block at PTR, of type BLKTYPE, to this cpu's magazines.
+ * Returns false if blocks of that type are not cached.
+ */
+static
+bool
+kmag_free(void *ptr, unsigned blktype)
+{
+	struct kmagcpu *kmc;
+	struct kmag *loaded, *previous;
+	vaddr_t freepages[KMAG_ROUNDS];
+	unsigned i, nfree;
+	int spl;
+
+	if (kmag_rounds[blktype] == 0 || !CURCPU_EXISTS()) {
+		return false;
+	}
+
+	/* As in subpage_put. */
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	nfree = 0;
+	spl = splhigh();
+	kmc = &curcpu->c_kmag;
+	loaded = &kmc->kmc_loaded[blktype];
+	previous = &kmc->kmc_previous[blktype];
+
+	if (loaded->km_count < kmag_rounds[blktype]) {
+		kmc->kmc_freehits++;
+	}
+	else if (previous->km_count == 0) {
+		kmag_swap(loaded, previous);
+		kmc->kmc_freehits++;
+	}
+	else {
+		kmc->kmc_freemisses++;
+		if (!kmag_depot_put(blktype, previous)) {
+			nfree = kmag_drain(previous, freepages);
+		}
+		kmag_swap(loaded, previous);
+	}
+
+	loaded->km_blocks[loaded->km_count++] = ptr;
+	splx(spl);
+
+	/* Pages go back with interrupts on, as in subpage_kfree. */
+	for (i=0; i<nfree; i++) {
+		free_kpages(freepages[i]);
+	}
+
+	return true;
+}
+
+/*
+ * Print magazine hit rates and depot occupancy. The per-cpu counts
+ * are read without stopping the cpus.
+ */
+static
+void
+kmag_printstats(void)
+{
+	struct kmagcpu *kmc;
+	unsigned i;
+
+	kprintf("Magazines (hits/misses):\n");
+	for (i=0; i<cpu_count(); i++) {
+		kmc = &cpu_get(i)->c_kmag;
+		kprintf("  cpu%u: alloc %u/%u, free %u/%u\n", i,
+			kmc->kmc_allochits, kmc->kmc_allocmisses,
+			kmc->kmc_freehits, kmc->kmc_freemisses);
+	}
+
+	spinlock_acquire(&kmag_depot_lock);
+	kprintf("  depot:");
+	for (i=0; i<NSIZES; i++) {
+		if (kmag_rounds[i] > 0) {
+			kprintf(" %lu:%u", (unsigned long)sizes[i],
+				kmag_ndepot[i]);
+		}
+	}
+	kprintf(" full magazines\n");
+	spinlock_release(&kmag_depot_lock);
+}
+
+//
+////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////
+//
+// Allocation profiler (options kmprof).
+//
+// kmalloc notes each block it hands out in a table of live blocks,
+// keyed by address, with its call site (kmalloc's return address),
+// size class and allocation time, and kfree takes it out again. Each
+// call site keeps running totals. Time is counted in kmalloc calls,
+// not read from a clock: it is cheap, works before the clock device
+// attaches, and "survived N allocations" is what matters for telling
+// a leak from a long-lived object anyway.
+//
+// Both tables are hash tables of fixed size with linear probing.
+// Sites are never removed. Blocks are, by shifting later entries of
+// the probe sequence back. Once a table is too full, further blocks
+// go untracked and are only counted.
+//
+// The return addresses can be turned into function names with
+// os161-addr2line on the kernel image.
+//
+
+#if OPT_KMPROF
+
+#define KMPROF_SITEBITS   8
+#define KMPROF_NSITES     (1 << KMPROF_SITEBITS)
+#define KMPROF_BLOCKBITS  12
+#define KMPROF_NBLOCKS    (1 << KMPROF_BLOCKBITS)
+#define KMPROF_TOP        10	/* sites shown per ranking */
+#define KMPROF_NOLD       20	/* unfreed blocks shown */
+#define KMPROF_OLDAGE     1000	/* kmallocs a block must survive */
+#define KMPROF_PAGES      NSIZES	/* size class of whole pages */
+
+struct kmprof_site {
+	vaddr_t ks_caller;		/* 0 if slot unused */
+	unsigned ks_allocs;		/* blocks allocated */
+	unsigned ks_frees;		/* ...and freed again */
+	unsigned ks_bytes;		/* bytes allocated */
+	unsigned ks_live;		/* blocks not yet freed */
+	unsigned ks_livebytes;		/* bytes not yet freed */
+};
+
+struct kmprof_block {
+	vaddr_t kb_addr;		/* 0 if slot unused */
+	uint32_t kb_time;		/* kmprof_clock when allocated */
+	uint32_t kb_size;		/* bytes handed out */
+	uint16_t kb_site;		/* index into kmprof_sites[] */
+	uint8_t kb_class;		/* blktype, or KMPROF_PAGES */
+};
+
+static struct kmprof_site kmprof_sites[KMPROF_NSITES];
+static struct kmprof_block kmprof_blocks[KMPROF_NBLOCKS];
+static unsigned kmprof_nsites, kmprof_nblocks;
+static unsigned kmprof_untracked;	/* allocations not in the tables */
+static uint32_t kmprof_clock;		/* kmalloc calls so far */
+static uint32_t kmprof_epoch;		/* kmprof_clock at last reset */
+static struct spinlock kmprof_lock = SPINLOCK_INITIALIZER;
+
+/* Fibonacci hashing; blocks are at least 16-byte aligned. */
+static
+unsigned
+kmprof_hash(vaddr_t addr, unsigned bits)
+{
+	return ((uint32_t)(addr >> 4) * 2654435761U) >> (32 - bits);
+}
+
+/*
+ * Find or add the site for CALLER. Returns -1 if the table is full.
+ */
+static
+int
+kmprof_site(vaddr_t caller)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kmprof_lock));
+
+	i = kmprof_hash(caller, KMPROF_SITEBITS);
+	while (kmprof_sites[i].ks_caller != caller) {
+		if (kmprof_sites[i].ks_caller == 0) {
+			if (kmprof_nsites >= KMPROF_NSITES*3/4) {
+				return -1;
+			}
+			kmprof_sites[i].ks_caller = caller;
+			kmprof_nsites++;
+			break;
+		}
+		i = (i + 1) % KMPROF_NSITES;
+	}
+	return i;
+}
+
+/*
+ * Slot of the block at ADDR, or -1 if it isn't being tracked.
+ */
+static
+int
+kmprof_findblock(vaddr_t addr)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kmprof_lock));
+
+	i = kmprof_hash(addr, KMPROF_BLOCKBITS);
+	while (kmprof_blocks[i].kb_addr != addr) {
+		if (kmprof_blocks[i].kb_addr == 0) {
+			return -1;
+		}
+		i = (i + 1) % KMPROF_NBLOCKS;
+	}
+	return i;
+}
+
+/*
+ * Empty slot I, moving up any later entry that would otherwise no
+ * longer be found from its home slot.
+ */
+static
+void
+kmprof_removeblock(unsigned i)
+{
+	unsigned j, home;
+
+	KASSERT(spinlock_do_i_hold(&kmprof_lock));
+
+	j = i;
+	for (;;) {
+		kmprof_blocks[i].kb_addr = 0;
+		for (;;) {
+			j = (j + 1) % KMPROF_NBLOCKS;
+			if (kmprof_blocks[j].kb_addr == 0) {
+				return;
+			}
+			home = kmprof_hash(kmprof_blocks[j].kb_addr,
+					   KMPROF_BLOCKBITS);
+			/* Stay put if home is cyclically in (i, j]. */
+			if (i <= j ? (i < home && home <= j)
+				   : (i < home || home <= j)) {
+				continue;
+			}
+			break;
+		}
+		kmprof_blocks[i] = kmprof_blocks[j];
+		i = j;
+	}
+}
+
+/*
+ * Note that kmalloc(SZ), called from CALLER, returned PTR.
+ */
+static
+void
+kmprof_alloc(void *ptr, size_t sz, vaddr_t caller)
+{
+	struct kmprof_block *kb;
+	struct kmprof_site *ks;
+	unsigned i, class, bytes;
+	int site;
+
+	if (sz >= LARGEST_SUBPAGE_SIZE) {
+		class = KMPROF_PAGES;
+		bytes = ROUNDUP(sz, PAGE_SIZE);
+	}
+	else {
+		class = blocktype(sz);
+		bytes = sizes[class];
+	}
+
+	spinlock_acquire(&kmprof_lock);
+	kmprof_clock++;
+
+	site = kmprof_site(caller);
+	if (site < 0 || kmprof_nblocks >= KMPROF_NBLOCKS*3/4) {
+		kmprof_untracked++;
+		spinlock_release(&kmprof_lock);
+		return;
+	}
+
+	i = kmprof_hash((vaddr_t)ptr, KMPROF_BLOCKBITS);
+	while (kmprof_blocks[i].kb_addr != 0) {
+		/* Otherwise it was given out twice. */
+		KASSERT(kmprof_blocks[i].kb_addr != (vaddr_t)ptr);
+		i = (i + 1) % KMPROF_NBLOCKS;
+	}
+	kb = &kmprof_blocks[i];
+	kb->kb_addr = (vaddr_t)ptr;
+	kb->kb_time = kmprof_clock;
+	kb->kb_size = bytes;
+	kb->kb_site = site;
+	kb->kb_class = class;
+	kmprof_nblocks++;
+
+	ks = &kmprof_sites[site];
+	ks->ks_allocs++;
+	ks->ks_bytes += bytes;
+	ks->ks_live++;
+	ks->ks_livebytes += bytes;
+
+	spinlock_release(&kmprof_lock);
+}
+
+/*
+ * Note that PTR is about to be freed.
+ */
+static
+void
+kmprof_free(void *ptr)
+{
+	struct kmprof_block *kb;
+	struct kmprof_site *ks;
+	int i;
+
+	spinlock_acquire(&kmprof_lock);
+	i = kmprof_findblock((vaddr_t)ptr);
+	if (i >= 0) {
+		kb = &kmprof_blocks[i];
+		ks = &kmprof_sites[kb->kb_site];
+		KASSERT(ks->ks_live > 0);
+		ks->ks_frees++;
+		ks->ks_live--;
+		ks->ks_livebytes -= kb->kb_size;
+		kmprof_removeblock(i);
+		kmprof_nblocks--;
+	}
+	spinlock_release(&kmprof_lock);
+}
+
+static
+unsigned
+kmprof_bybytes(const struct kmprof_site *ks)
+{
+	return ks->ks_bytes;
+}
+
+static
+unsigned
+kmprof_bylive(const struct kmprof_site *ks)
+{
+	return ks->ks_live;
+}
+
+static
+unsigned
+kmprof_bychurn(const struct kmprof_site *ks)
+{
+	return ks->ks_frees;
+}
+
+/*
+ * Print the KMPROF_TOP sites with the largest nonzero KEY.
+ */
+static
+void
+kmprof_printtop(const char *title,
+		unsigned (*key)(const struct kmprof_site *))
+{
+	const struct kmprof_site *ks;
+	unsigned top[KMPROF_TOP];
+	unsigned ntop, i, j;
+
+	KASSERT(spinlock_do_i_hold(&kmprof_lock));
+
+	/* Insertion sort into top[], largest first. */
+	ntop = 0;
+	for (i=0; i<KMPROF_NSITES; i++) {
+		ks = &kmprof_sites[i];
+		if (ks->ks_caller == 0 || key(ks) == 0) {
+			continue;
+		}
+		for (j = ntop; j > 0 && key(&kmprof_sites[top[j-1]]) < key(ks);
+		     j--) {
+			if (j < KMPROF_TOP) {
+				top[j] = top[j-1];
+			}
+		}
+		if (j < KMPROF_TOP) {
+			top[j] = i;
+			if (ntop < KMPROF_TOP) {
+				ntop++;
+			}
+		}
+	}
+
+	kprintf("Top sites by %s:\n", title);
+	kprintf("  %-10s %8s %8s %10s %7s %10s\n", "caller", "allocs",
+		"frees", "bytes", "live", "live bytes");
+	for (i=0; i<ntop; i++) {
+		ks = &kmprof_sites[top[i]];
+		kprintf("  0x%08lx %8u %8u %10u %7u %10u\n",
+			(unsigned long)ks->ks_caller, ks->ks_allocs,
+			ks->ks_frees, ks->ks_bytes, ks->ks_live,
+			ks->ks_livebytes);
+	}
+}
+
+/*
+ * Print the KMPROF_NOLD oldest blocks allocated since the last reset
+ * that have survived at least KMPROF_OLDAGE further kmallocs.
+ */
+static
+void
+kmprof_printold(void)
+{
+	const struct kmprof_block *kb;
+	unsigned old[KMPROF_NOLD];
+	unsigned nold, nmatch, i, j;
+	uint32_t age;
+
+	KASSERT(spinlock_do_i_hold(&kmprof_lock));
+
+	nold = nmatch = 0;
+	for (i=0; i<KMPROF_NBLOCKS; i++) {
+		kb = &kmprof_blocks[i];
+		if (kb->kb_addr == 0 || kb->kb_time <= kmprof_epoch ||
+		    kmprof_clock - kb->kb_time < KMPROF_OLDAGE) {
+			continue;
+		}
+		nmatch++;
+		for (j = nold;
+		     j > 0 && kmprof_blocks[old[j-1]].kb_time > kb->kb_time;
+		     j--) {
+			if (j < KMPROF_NOLD) {
+				old[j] = old[j-1];
+			}
+		}
+		if (j < KMPROF_NOLD) {
+			old[j] = i;
+			if (nold < KMPROF_NOLD) {
+				nold++;
+			}
+		}
+	}
+
+	kprintf("Unfreed blocks allocated since the last reset, at least "
+		"%u kmallocs ago: %u\n", KMPROF_OLDAGE, nmatch);
+	kprintf("  %-10s %6s %10s %10s\n", "address", "size", "caller",
+		"age");
+	for (i=0; i<nold; i++) {
+		kb = &kmprof_blocks[old[i]];
+		age = kmprof_clock - kb->kb_time;
+		kprintf("  0x%08lx %6u 0x%08lx %10u\n",
+			(unsigned long)kb->kb_addr, kb->kb_size,
+			(unsigned long)kmprof_sites[kb->kb_site].ks_caller,
+			(unsigned)age);
+	}
+}
+
+void
+kmprof_printstats(void)
+{
+	/* Print with the tables held still, like kheap_printstats. */
+	spinlock_acquire(&kmprof_lock);
+
+	kprintf("kmalloc profile: %u kmallocs, %u since reset; "
+		"%u sites, %u live blocks, %u untracked\n",
+		(unsigned)kmprof_clock, (unsigned)(kmprof_clock - kmprof_epoch),
+		kmprof_nsites, kmprof_nblocks, kmprof_untracked);
+	kmprof_printtop("bytes allocated", kmprof_bybytes);
+	kmprof_printtop("live blocks", kmprof_bylive);
+	kmprof_printtop("churn (blocks freed)", kmprof_bychurn);
+	kmprof_printold();
+
+	spinlock_release(&kmprof_lock);
+}
+
+void
+kmprof_reset(void)
+{
+	struct kmprof_site *ks;
+	unsigned i;
+
+	/*
+	 * Live counts stay, since the blocks are still out there, and so
+	 * do the blocks; only the totals start over.
+	 */
+	spinlock_acquire(&kmprof_lock);
+	for (i=0; i<KMPROF_NSITES; i++) {
+		ks = &kmprof_sites[i];
+		ks->ks_allocs = 0;
+		ks->ks_frees = 0;
+		ks->ks_bytes = 0;
+	}
+	kmprof_untracked = 0;
+	kmprof_epoch = kmprof_clock;
+	spinlock_release(&kmprof_lock);
+}
+
+#else /* !OPT_KMPROF */
+
+void
+kmprof_printstats(void)
+{
+	kprintf("kmalloc profiler not compiled in (options kmprof)\n");
+}
+
+void
+kmprof_reset(void)
+{
+}
+
+#endif /* OPT_KMPROF */
+
 //
 ////////////////////////////////////////////////////////////
 
 void *
 kmalloc(size_t sz)
 {
+	void *ptr;
+
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
@@ -608,27 +1439,53 @@ kmalloc(size_t sz)
 		/* Round up to a whole number of pages. */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
 		address = alloc_kpages(npages);
-		if (address==0) {
-			return NULL;
+		ptr = (void *)address;
+	}
+	else {
+		ptr = kmag_alloc(blocktype(sz));
+		if (ptr == NULL) {
+			ptr = subpage_kmalloc(sz);
 		}
-
-		return (void *)address;
 	}
 
-	return subpage_kmalloc(sz);
+#if OPT_KMPROF
+	if (ptr != NULL) {
+		kmprof_alloc(ptr, sz, (vaddr_t)__builtin_return_address(0));
+	}
+#endif
+	return ptr;
 }
 
 void
 kfree(void *ptr)
 {
+	struct pageref *pr;
+	int blktype;
+
 	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
+	 * Subpage blocks go to a magazine if they can, and otherwise
+	 * straight back to their page; anything not on a subpage page
+	 * must be a big allocation.
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+#if OPT_KMPROF
+	kmprof_free(ptr);
+#endif
+	pr = pagerefmap_get((vaddr_t)ptr);
+	if (pr == NULL) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
+	else {
+		blktype = PR_BLOCKTYPE(pr);
+		if (((vaddr_t)ptr & ~PAGE_FRAME) % sizes[blktype] != 0) {
+			panic("kfree: subpage free of invalid addr %p\n", ptr);
+		}
+		if (!kmag_free(ptr, blktype)) {
+			subpage_kfree(ptr);
+		}
+	}
 }
 
@@ -0,0 +1,354 @@
+/*
+ * Object caches. See kmemcache.h.
+ *
+ * Each slab is one page from alloc_kpages, with a struct kmem_slab at
+ * the start and the objects after it. Free objects of a slab are
+ * chained through a link word kept just past the end of each object,
+ * so the object itself, constructed state and all, is left alone.
+ *
+ * A cache keeps its slabs on three lists: partly used, wholly used,
+ * and wholly free. Allocation prefers partly used slabs, to let the
+ * others drain. One spinlock per cache covers its lists and slabs;
+ * like kmalloc, it is dropped around the page allocator and around
+ * constructors and destructors, which may allocate or sleep.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmemcache.h>
+
+struct kmem_slab {
+	struct kmem_cache *ks_cache;
+	struct kmem_slab *ks_next;	/* on one of the cache's lists */
+	struct kmem_slab *ks_prev;
+	void *ks_free;			/* first free object, or NULL */
+	unsigned ks_inuse;		/* objects handed out */
+};
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;			/* object size asked for */
+	size_t kc_stride;		/* object plus link, aligned */
+	unsigned kc_perslab;		/* objects per slab */
+	kmem_ctor kc_ctor;
+	kmem_dtor kc_dtor;
+	struct spinlock kc_lock;
+	struct kmem_slab *kc_partial;	/* some objects free */
+	struct kmem_slab *kc_full;	/* no objects free */
+	struct kmem_slab *kc_empty;	/* all objects free */
+	unsigned kc_nempty;		/* slabs on kc_empty */
+	unsigned kc_nslabs;		/* slabs on all three lists */
+	unsigned kc_inuse;		/* objects handed out */
+	unsigned kc_allocs;		/* kmem_cache_alloc calls served */
+	unsigned kc_ctors;		/* constructor calls */
+	struct kmem_cache *kc_next;	/* on kmem_caches */
+};
+
+/* Objects start this far into a slab. */
+#define KMEM_HDRSIZE   ROUNDUP(sizeof(struct kmem_slab), 8)
+
+/* The link word of OBJ. */
+#define KMEM_LINK(kc, obj) \
+	((void **)((char *)(obj) + (kc)->kc_stride - sizeof(void *)))
+
+/* The slab holding OBJ. */
+#define KMEM_SLAB(obj) \
+	((struct kmem_slab *)((vaddr_t)(obj) & PAGE_FRAME))
+
+/* All caches, for kmem_cache_printstats. */
+static struct kmem_cache *kmem_caches;
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+
+////////////////////////////////////////////////////////////
+//
+// Slab lists
+
+static
+void
+slab_push(struct kmem_slab **list, struct kmem_slab *ks)
+{
+	ks->ks_prev = NULL;
+	ks->ks_next = *list;
+	if (*list != NULL) {
+		(*list)->ks_prev = ks;
+	}
+	*list = ks;
+}
+
+static
+void
+slab_unlink(struct kmem_slab **list, struct kmem_slab *ks)
+{
+	if (ks->ks_prev != NULL) {
+		ks->ks_prev->ks_next = ks->ks_next;
+	}
+	else {
+		KASSERT(*list == ks);
+		*list = ks->ks_next;
+	}
+	if (ks->ks_next != NULL) {
+		ks->ks_next->ks_prev = ks->ks_prev;
+	}
+	ks->ks_next = ks->ks_prev = NULL;
+}
+
+/*
+ * Address of object number I of slab KS.
+ */
+static
+void *
+slab_obj(struct kmem_cache *kc, struct kmem_slab *ks, unsigned i)
+{
+	return (char *)ks + KMEM_HDRSIZE + i * kc->kc_stride;
+}
+
+/*
+ * Run the destructor on the first N objects of KS and give its page
+ * back. Called without the cache lock, on a slab that is on no list.
+ */
+static
+void
+slab_destroy(struct kmem_cache *kc, struct kmem_slab *ks, unsigned n)
+{
+	unsigned i;
+
+	KASSERT(ks->ks_inuse == 0);
+
+	if (kc->kc_dtor != NULL) {
+		for (i=0; i<n; i++) {
+			kc->kc_dtor(slab_obj(kc, ks, i));
+		}
+	}
+	free_kpages((vaddr_t)ks);
+}
+
+/*
+ * Make a new slab for KC with every object constructed and free.
+ * Called without the cache lock. Returns NULL if out of memory or if
+ * a constructor failed.
+ */
+static
+struct kmem_slab *
+slab_create(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	void *obj;
+	unsigned i;
+	int result;
+
+	ks = (struct kmem_slab *)alloc_kpages(1);
+	if (ks == NULL) {
+		return NULL;
+	}
+	ks->ks_cache = kc;
+	ks->ks_next = ks->ks_prev = NULL;
+	ks->ks_free = NULL;
+	ks->ks_inuse = 0;
+
+	/* Chained in reverse, so the first object is handed out first. */
+	for (i=kc->kc_perslab; i-- > 0; ) {
+		obj = slab_obj(kc, ks, i);
+		*KMEM_LINK(kc, obj) = ks->ks_free;
+		ks->ks_free = obj;
+	}
+
+	if (kc->kc_ctor != NULL) {
+		for (i=0; i<kc->kc_perslab; i++) {
+			result = kc->kc_ctor(slab_obj(kc, ks, i));
+			if (result) {
+				slab_destroy(kc, ks, i);
+				return NULL;
+			}
+		}
+		spinlock_acquire(&kc->kc_lock);
+		kc->kc_ctors += kc->kc_perslab;
+		spinlock_release(&kc->kc_lock);
+	}
+
+	return ks;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  kmem_ctor ctor, kmem_dtor dtor)
+{
+	struct kmem_cache *kc;
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_stride = ROUNDUP(size + sizeof(void *), 8);
+	if (KMEM_HDRSIZE + kc->kc_stride > PAGE_SIZE) {
+		panic("kmem_cache_create: %s: %lu byte objects too big\n",
+		      name, (unsigned long)size);
+	}
+	kc->kc_perslab = (PAGE_SIZE - KMEM_HDRSIZE) / kc->kc_stride;
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+	spinlock_init(&kc->kc_lock);
+	kc->kc_partial = kc->kc_full = kc->kc_empty = NULL;
+	kc->kc_nempty = 0;
+	kc->kc_nslabs = 0;
+	kc->kc_inuse = 0;
+	kc->kc_allocs = 0;
+	kc->kc_ctors = 0;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_caches_lock);
+
+	return kc;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **kcp;
+	struct kmem_slab *ks;
+
+	KASSERT(kc->kc_inuse == 0);
+	KASSERT(kc->kc_partial == NULL && kc->kc_full == NULL);
+
+	spinlock_acquire(&kmem_caches_lock);
+	for (kcp = &kmem_caches; *kcp != kc; kcp = &(*kcp)->kc_next) {
+		KASSERT(*kcp != NULL);
+	}
+	*kcp = kc->kc_next;
+	spinlock_release(&kmem_caches_lock);
+
+	while (kc->kc_empty != NULL) {
+		ks = kc->kc_empty;
+		slab_unlink(&kc->kc_empty, ks);
+		slab_destroy(kc, ks, kc->kc_perslab);
+	}
+
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	void *obj;
+
+	spinlock_acquire(&kc->kc_lock);
+	while (kc->kc_partial == NULL && kc->kc_empty == NULL) {
+		/*
+		 * Drop the lock for the page allocator and the
+		 * constructors. Someone may free an object meanwhile,
+		 * in which case the new slab just joins the free ones.
+		 */
+		spinlock_release(&kc->kc_lock);
+		ks = slab_create(kc);
+		if (ks == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&kc->kc_lock);
+		slab_push(&kc->kc_empty, ks);
+		kc->kc_nempty++;
+		kc->kc_nslabs++;
+	}
+
+	ks = kc->kc_partial;
+	if (ks == NULL) {
+		ks = kc->kc_empty;
+		slab_unlink(&kc->kc_empty, ks);
+		kc->kc_nempty--;
+		slab_push(&kc->kc_partial, ks);
+	}
+
+	obj = ks->ks_free;
+	KASSERT(obj != NULL);
+	ks->ks_free = *KMEM_LINK(kc, obj);
+	ks->ks_inuse++;
+	if (ks->ks_free == NULL) {
+		slab_unlink(&kc->kc_partial, ks);
+		slab_push(&kc->kc_full, ks);
+	}
+	kc->kc_inuse++;
+	kc->kc_allocs++;
+	spinlock_release(&kc->kc_lock);
+
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *ks;
+
+	ks = KMEM_SLAB(obj);
+	KASSERT(ks->ks_cache == kc);
+	KASSERT(((char *)obj - (char *)ks - KMEM_HDRSIZE)
+		% kc->kc_stride == 0);
+
+	spinlock_acquire(&kc->kc_lock);
+	KASSERT(ks->ks_inuse > 0);
+
+	if (ks->ks_free == NULL) {
+		slab_unlink(&kc->kc_full, ks);
+		slab_push(&kc->kc_partial, ks);
+	}
+	*KMEM_LINK(kc, obj) = ks->ks_free;
+	ks->ks_free = obj;
+	ks->ks_inuse--;
+	kc->kc_inuse--;
+
+	if (ks->ks_inuse > 0) {
+		spinlock_release(&kc->kc_lock);
+		return;
+	}
+
+	slab_unlink(&kc->kc_partial, ks);
+	if (kc->kc_nempty < KMEM_MAXEMPTY) {
+		slab_push(&kc->kc_empty, ks);
+		kc->kc_nempty++;
+		spinlock_release(&kc->kc_lock);
+		return;
+	}
+	kc->kc_nslabs--;
+	spinlock_release(&kc->kc_lock);
+
+	slab_destroy(kc, ks, kc->kc_perslab);
+}
+
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+	unsigned nslabs, inuse, allocs, ctors;
+
+	kprintf("Object caches:\n");
+	kprintf("  %-12s %5s %4s %6s %7s %9s %9s\n", "name", "size",
+		"/pg", "slabs", "in use", "allocs", "ctors");
+
+	/* Caches are never destroyed while the menu runs. */
+	spinlock_acquire(&kmem_caches_lock);
+	kc = kmem_caches;
+	spinlock_release(&kmem_caches_lock);
+
+	for (; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		nslabs = kc->kc_nslabs;
+		inuse = kc->kc_inuse;
+		allocs = kc->kc_allocs;
+		ctors = kc->kc_ctors;
+		spinlock_release(&kc->kc_lock);
+
+		kprintf("  %-12s %5lu %4u %6u %7u %9u %9u\n", kc->kc_name,
+			(unsigned long)kc->kc_size, kc->kc_perslab,
+			nslabs, inuse, allocs, ctors);
+	}
+}
@@ -0,0 +1,91 @@
+/*
+ * Two-level user page tables. See pagetable.h for the layout.
+ *
+ * Second-level tables are exactly one page, so they come straight
+ * from alloc_kpages rather than kmalloc.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <vm.h>
+#include <pagetable.h>
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+	unsigned i;
+
+	pt = kmalloc(sizeof(struct pagetable));
+	if (pt == NULL) {
+		return NULL;
+	}
+	for (i=0; i<PT_L1ENTRIES; i++) {
+		pt->pt_dir[i] = NULL;
+	}
+	return pt;
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	unsigned i;
+
+	for (i=0; i<PT_L1ENTRIES; i++) {
+		if (pt->pt_dir[i] != NULL) {
+			free_kpages((vaddr_t)pt->pt_dir[i]);
+		}
+	}
+	kfree(pt);
+}
+
+pte_t *
+pt_lookup(struct pagetable *pt, vaddr_t va, bool create)
+{
+	pte_t *l2;
+	vaddr_t page;
+
+	KASSERT(va < USERSPACETOP);
+
+	l2 = pt->pt_dir[PT_L1INDEX(va)];
+	if (l2 == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		page = alloc_kpages(1);
+		if (page == 0) {
+			return NULL;
+		}
+		l2 = (pte_t *)page;
+		bzero(l2, PAGE_SIZE);
+		pt->pt_dir[PT_L1INDEX(va)] = l2;
+	}
+	return &l2[PT_L2INDEX(va)];
+}
+
+int
+pt_walk(struct pagetable *pt, pt_walkfunc func, void *data)
+{
+	unsigned i, j;
+	pte_t *l2;
+	int result;
+
+	for (i=0; i<PT_L1ENTRIES; i++) {
+		l2 = pt->pt_dir[i];
+		if (l2 == NULL) {
+			continue;
+		}
+		for (j=0; j<PT_L2ENTRIES; j++) {
+			if (l2[j] == 0) {
+				continue;
+			}
+			result = func((vaddr_t)i << PT_L1SHIFT |
+				      (vaddr_t)j << PT_L2SHIFT,
+				      &l2[j], data);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * Swap space on a raw disk device. See swap.h.
+ *
+ * The raw device is read and written a page at a time through a
+ * kernel uio aimed at the frame's direct-mapped address, so no
+ * buffering is involved. Slot N lives at byte offset N * PAGE_SIZE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <vm.h>
+#include <swap.h>
+
+static struct vnode *swap_vnode;	/* NULL if there is no swap */
+static struct bitmap *swap_map;		/* one bit per slot, set if in use */
+static unsigned swap_nslots;
+static unsigned swap_used;
+
+/* Protects swap_map and swap_used. */
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+void
+swap_bootstrap(void)
+{
+	char path[] = SWAP_DEVICE;
+	struct stat st;
+	int result;
+
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		kprintf("swap: %s: %s; paging disabled\n", SWAP_DEVICE,
+			strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result == 0) {
+		swap_nslots = st.st_size / PAGE_SIZE;
+		swap_map = bitmap_create(swap_nslots);
+	}
+	if (result || swap_nslots == 0 || swap_map == NULL) {
+		kprintf("swap: cannot use %s; paging disabled\n",
+			SWAP_DEVICE);
+		vfs_close(swap_vnode);
+		swap_vnode = NULL;
+		return;
+	}
+
+	kprintf("swap: %u slots (%u KB) on %s\n", swap_nslots,
+		swap_nslots * (PAGE_SIZE / 1024), SWAP_DEVICE);
+}
+
+int
+swap_alloc(unsigned *slot)
+{
+	int result;
+
+	if (swap_vnode == NULL) {
+		return ENOSPC;
+	}
+
+	spinlock_acquire(&swap_lock);
+	result = bitmap_alloc(swap_map, slot);
+	if (result == 0) {
+		swap_used++;
+	}
+	spinlock_release(&swap_lock);
+	return result;
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(bitmap_isset(swap_map, slot));
+	bitmap_unmark(swap_map, slot);
+	swap_used--;
+	spinlock_release(&swap_lock);
+}
+
+/*
+ * Move one page between PADDR and SLOT in direction RW.
+ */
+static
+int
+swap_io(unsigned slot, paddr_t paddr, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	KASSERT(swap_vnode != NULL);
+	KASSERT(slot < swap_nslots);
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &u);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &u);
+	}
+	if (result) {
+		return result;
+	}
+	if (u.uio_resid != 0) {
+		return EIO;
+	}
+	return 0;
+}
+
+int
+swap_in(unsigned slot, paddr_t paddr)
+{
+	return swap_io(slot, paddr, UIO_READ);
+}
+
+int
+swap_out(unsigned slot, paddr_t paddr)
+{
+	return swap_io(slot, paddr, UIO_WRITE);
+}
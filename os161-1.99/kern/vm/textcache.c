@@ -0,0 +1,155 @@
+/*
+ * Shared text pages. See textcache.h.
+ *
+ * A small chained hash table under one sleep lock. The lock also
+ * covers the decision to drop an entry: a frame's last reference can
+ * only be dropped by textcache_release, and the only way to gain one
+ * without already holding one is textcache_lookup, so a reference
+ * count of 1 seen under the lock stays 1.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <synch.h>
+#include <vm.h>
+#include <coremap.h>
+#include <textcache.h>
+
+struct textpage {
+	struct textpage *tp_next;	/* hash chain */
+	struct vnode *tp_vnode;
+	vaddr_t tp_vaddr;
+	paddr_t tp_paddr;
+};
+
+static struct textpage *textcache[TEXTCACHE_BUCKETS];
+static struct lock *textcache_lock;
+static unsigned textcache_count;	/* entries */
+static unsigned textcache_hits;		/* faults served from the cache */
+static unsigned textcache_misses;	/* ...and ones that had to read */
+
+static
+unsigned
+textcache_hash(struct vnode *v, vaddr_t va)
+{
+	return ((uintptr_t)v / sizeof(void *) + va / PAGE_SIZE)
+		% TEXTCACHE_BUCKETS;
+}
+
+/*
+ * Find the entry for VA of V, returning the link that points at it
+ * (or at NULL, if there is none). Called with the lock held.
+ */
+static
+struct textpage **
+textcache_find(struct vnode *v, vaddr_t va)
+{
+	struct textpage **tpp;
+
+	KASSERT(lock_do_i_hold(textcache_lock));
+
+	tpp = &textcache[textcache_hash(v, va)];
+	while (*tpp != NULL) {
+		if ((*tpp)->tp_vnode == v && (*tpp)->tp_vaddr == va) {
+			break;
+		}
+		tpp = &(*tpp)->tp_next;
+	}
+	return tpp;
+}
+
+void
+textcache_bootstrap(void)
+{
+	textcache_lock = lock_create("textcache");
+	if (textcache_lock == NULL) {
+		panic("textcache_bootstrap: out of memory\n");
+	}
+}
+
+paddr_t
+textcache_lookup(struct vnode *v, vaddr_t va)
+{
+	struct textpage *tp;
+	paddr_t paddr = 0;
+
+	lock_acquire(textcache_lock);
+	tp = *textcache_find(v, va);
+	if (tp != NULL) {
+		paddr = tp->tp_paddr;
+		coremap_share(paddr);
+		textcache_hits++;
+	}
+	else {
+		textcache_misses++;
+	}
+	lock_release(textcache_lock);
+	return paddr;
+}
+
+paddr_t
+textcache_insert(struct vnode *v, vaddr_t va, paddr_t paddr)
+{
+	struct textpage *tp, *new;
+	struct textpage **tpp;
+
+	/* Allocate first; kmalloc may need to evict pages. */
+	new = kmalloc(sizeof(*new));
+
+	lock_acquire(textcache_lock);
+	tpp = textcache_find(v, va);
+	tp = *tpp;
+	if (tp != NULL) {
+		/* Lost a race with another process reading the page. */
+		coremap_share(tp->tp_paddr);
+		lock_release(textcache_lock);
+		coremap_free(paddr);
+		kfree(new);
+		return tp->tp_paddr;
+	}
+	if (new != NULL) {
+		new->tp_next = NULL;
+		new->tp_vnode = v;
+		new->tp_vaddr = va;
+		new->tp_paddr = paddr;
+		*tpp = new;
+		textcache_count++;
+	}
+	lock_release(textcache_lock);
+	return paddr;
+}
+
+void
+textcache_release(struct vnode *v, vaddr_t va, paddr_t paddr)
+{
+	struct textpage *tp;
+	struct textpage **tpp;
+
+	lock_acquire(textcache_lock);
+	tpp = textcache_find(v, va);
+	tp = *tpp;
+	if (tp != NULL && tp->tp_paddr == paddr &&
+	    coremap_refcount(paddr) == 1) {
+		*tpp = tp->tp_next;
+		textcache_count--;
+		kfree(tp);
+	}
+	coremap_free(paddr);
+	lock_release(textcache_lock);
+}
+
+void
+textcache_printstats(void)
+{
+	unsigned count, hits, misses;
+
+	lock_acquire(textcache_lock);
+	count = textcache_count;
+	hits = textcache_hits;
+	misses = textcache_misses;
+	lock_release(textcache_lock);
+
+	kprintf("Text cache: %u pages, %u/%u hit/miss (%u%%)\n",
+		count, hits, misses,
+		hits + misses ? hits * 100 / (hits + misses) : 0);
+}
@@ -2,22 +2,21 @@
 
 /* belongs in kern/vm/uw-vmstats.c */
 
-/* NOTE !!!!!! WARNING !!!!!
- * All of the functions whose names begin with '_'
- * assume that atomicity is ensured elsewhere
- * (i.e., outside of these routines) by acquiring stats_lock.
- * All of the functions whose names do not begin
- * with '_' ensure atomicity locally.
+/* The counts live in struct cpu, one set per cpu, and are summed
+ * when read; see uw-vmstats.h. stats_lock now only serializes
+ * vmstats_init.
  */
 
 #include <types.h>
 #include <lib.h>
 #include <synch.h>
 #include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <thread.h>
+#include <proc.h>
 #include <uw-vmstats.h>
-
-/* Counters for tracking statistics */
-static unsigned int stats_counts[VMSTAT_COUNT];
+#include "opt-A3.h"
 
 struct spinlock stats_lock = SPINLOCK_INITIALIZER;
 
@@ -33,6 +32,13 @@ static const char *stats_names[] = {
  /*  7 */ "Page Faults from ELF",
  /*  8 */ "Page Faults from Swapfile",
  /*  9 */ "Swapfile Writes",
+ /* 10 */ "COW Faults",
+ /* 11 */ "COW Copies Avoided",
+ /* 12 */ "Address Space Activations",
+ /* 13 */ "ASID Rollovers",
+ /* 14 */ "TLB Shootdown IPIs",
+ /* 15 */ "TLB Shootdown Pages",
+ /* 16 */ "Page Faults from Mapped Files",
 };
 
 
@@ -41,9 +47,22 @@ static const char *stats_names[] = {
 void
 vmstats_inc(unsigned int index)
 {
-    spinlock_acquire(&stats_lock);
-      _vmstats_inc(index);
-    spinlock_release(&stats_lock);
+  _vmstats_inc(index);
+}
+
+/* ---------------------------------------------------------------------- */
+/* Assumes vmstat_init has already been called */
+unsigned int
+vmstats_get(unsigned int index)
+{
+  unsigned int count, i;
+
+  KASSERT(index < VMSTAT_COUNT);
+  count = 0;
+  for (i=0; i<cpu_count(); i++) {
+    count += cpu_get(i)->c_vmstats[index];
+  }
+  return count;
 }
 
 /* ---------------------------------------------------------------------- */
@@ -64,15 +83,29 @@ vmstats_init(void)
 void
 _vmstats_inc(unsigned int index)
 {
+  int spl;
+
   KASSERT(index < VMSTAT_COUNT);
-  stats_counts[index]++;
+
+  /* Interrupts off so we stay on this cpu and an interrupt handler
+   * counting on it does not lose our increment.
+   */
+  spl = splhigh();
+  curcpu->c_vmstats[index]++;
+#if OPT_A3
+  if (!curthread->t_in_interrupt && curproc != NULL && curproc != kproc) {
+    curproc->p_vmstats[index]++;
+  }
+#endif /* OPT_A3 */
+  splx(spl);
 }
 
 /* ---------------------------------------------------------------------- */
 void
 _vmstats_init(void)
 {
-  int i = 0;
+  unsigned int i, j;
+  struct cpu *c;
 
   if (sizeof(stats_names) / sizeof(char *) != VMSTAT_COUNT) {
     kprintf("vmstats_init: number of stats_names = %d != VMSTAT_COUNT = %d\n",
@@ -80,8 +113,11 @@ _vmstats_init(void)
     panic("Should really fix this before proceeding\n");
   }
 
-  for (i=0; i<VMSTAT_COUNT; i++) {
-    stats_counts[i] = 0;
+  for (j=0; j<cpu_count(); j++) {
+    c = cpu_get(j);
+    for (i=0; i<VMSTAT_COUNT; i++) {
+      c->c_vmstats[i] = 0;
+    }
   }
 
 }
@@ -102,6 +138,12 @@ vmstats_print(void)
   int tlb_faults = 0;
   int elf_plus_swap_reads = 0;
   int disk_reads = 0;
+  unsigned int stats_counts[VMSTAT_COUNT];
+
+  /* Take one snapshot so the checks below agree with what we print. */
+  for (i=0; i<VMSTAT_COUNT; i++) {
+    stats_counts[i] = vmstats_get(i);
+  }
 
   kprintf("VMSTATS:\n");
   for (i=0; i<VMSTAT_COUNT; i++) {
@@ -112,7 +154,8 @@ vmstats_print(void)
   free_plus_replace = stats_counts[VMSTAT_TLB_FAULT_FREE] + stats_counts[VMSTAT_TLB_FAULT_REPLACE];
   disk_plus_zeroed_plus_reload = stats_counts[VMSTAT_PAGE_FAULT_DISK] +
     stats_counts[VMSTAT_PAGE_FAULT_ZERO] + stats_counts[VMSTAT_TLB_RELOAD];
-  elf_plus_swap_reads = stats_counts[VMSTAT_ELF_FILE_READ] + stats_counts[VMSTAT_SWAP_FILE_READ];
+  elf_plus_swap_reads = stats_counts[VMSTAT_ELF_FILE_READ] + stats_counts[VMSTAT_SWAP_FILE_READ] +
+    stats_counts[VMSTAT_MAP_FILE_READ];
   disk_reads = stats_counts[VMSTAT_PAGE_FAULT_DISK];
 
   kprintf("VMSTAT TLB Faults with Free + TLB Faults with Replace = %d\n", free_plus_replace);
@@ -128,10 +171,30 @@ vmstats_print(void)
       tlb_faults, disk_plus_zeroed_plus_reload); 
   }
 
-  kprintf("VMSTAT ELF File reads + Swapfile reads = %d\n", elf_plus_swap_reads);
+  kprintf("VMSTAT ELF File reads + Swapfile reads + Mapped File reads = %d\n", elf_plus_swap_reads);
   if (disk_reads != elf_plus_swap_reads) {
-    kprintf("WARNING: ELF File reads + Swapfile reads != Page Faults (Disk) %d\n",
+    kprintf("WARNING: ELF File reads + Swapfile reads + Mapped File reads != Page Faults (Disk) %d\n",
       elf_plus_swap_reads);
   }
 }
 /* ---------------------------------------------------------------------- */
+
+#if OPT_A3
+/* Print the counts charged to process P, skipping the zero ones.
+ * Called by sys__exit when DB_VMSTAT is set; P is still running, so
+ * its counts are not moving under us.
+ */
+void
+vmstats_printproc(struct proc *p)
+{
+  int i;
+
+  kprintf("VMSTATS for %s:\n", p->p_name);
+  for (i=0; i<VMSTAT_COUNT; i++) {
+    if (p->p_vmstats[i] != 0) {
+      kprintf("VMSTAT %25s = %10u\n", stats_names[i], p->p_vmstats[i]);
+    }
+  }
+}
+#endif /* OPT_A3 */
+/* ---------------------------------------------------------------------- */
@@ -0,0 +1,158 @@
+/*
+ * shresp - response time of shell commands while CPU hogs run.
+ *
+ *  usage: shresp [nhogs [ncmds]]
+ *
+ *  Runs "sh -c true" NCMDS times (default 10) on an idle system and
+ *  prints the shortest, mean and longest time from fork to waitpid.
+ *  Then starts NHOGS (default 4) children that do nothing but spin
+ *  for HOGSECS seconds and does it again. With round-robin scheduling
+ *  each command waits behind every hog in turn; a scheduler that
+ *  favors threads that block should keep the loaded times close to
+ *  the idle ones.
+ *
+ *  relies on fork, execv, waitpid, _exit and __time
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+
+#define MAXHOGS  16
+#define HOGSECS  30
+
+static char *shargv[4] = { (char *)"sh", (char *)"-c", (char *)"true", NULL };
+
+static pid_t hogs[MAXHOGS];
+
+/* Current time in milliseconds. */
+static
+unsigned long
+now_ms(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return (unsigned long)secs * 1000 + nsecs / 1000000;
+}
+
+static
+void
+hog(unsigned long until)
+{
+	volatile unsigned i;
+
+	while (now_ms() < until) {
+		for (i=0; i<100000; i++) {
+			;
+		}
+	}
+	_exit(0);
+}
+
+/* Run one command; returns how long it took in milliseconds. */
+static
+unsigned long
+runcmd(void)
+{
+	unsigned long start;
+	pid_t pid;
+	int status;
+
+	start = now_ms();
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		execv("/bin/sh", shargv);
+		err(1, "/bin/sh");
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "sh -c true failed");
+	}
+	return now_ms() - start;
+}
+
+/*
+ * Run NCMDS commands and print the results. If UNTIL is nonzero,
+ * commands started after then are not counted, since the hogs are
+ * gone by that time.
+ */
+static
+void
+measure(const char *what, int ncmds, unsigned long until)
+{
+	unsigned long t, min, max, total;
+	int i, n;
+
+	min = max = total = 0;
+	n = 0;
+	for (i=0; i<ncmds; i++) {
+		if (until != 0 && now_ms() >= until) {
+			break;
+		}
+		t = runcmd();
+		if (n == 0 || t < min) {
+			min = t;
+		}
+		if (t > max) {
+			max = t;
+		}
+		total += t;
+		n++;
+	}
+
+	if (n == 0) {
+		printf("%s: no commands finished\n", what);
+		return;
+	}
+	printf("%s: %d commands, min %lu ms, mean %lu ms, max %lu ms\n",
+	       what, n, min, total / n, max);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int nhogs = 4, ncmds = 10;
+	unsigned long until;
+	int i, status;
+
+	if (argc > 1) {
+		nhogs = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		ncmds = atoi(argv[2]);
+	}
+	if (nhogs < 0 || nhogs > MAXHOGS || ncmds <= 0) {
+		errx(1, "usage: shresp [nhogs (0-%d) [ncmds]]", MAXHOGS);
+	}
+
+	measure("idle", ncmds, 0);
+
+	until = now_ms() + HOGSECS * 1000;
+	for (i=0; i<nhogs; i++) {
+		hogs[i] = fork();
+		if (hogs[i] < 0) {
+			err(1, "fork");
+		}
+		if (hogs[i] == 0) {
+			hog(until);
+		}
+	}
+
+	printf("%d hogs running for %d seconds\n", nhogs, HOGSECS);
+	measure("loaded", ncmds, until);
+
+	for (i=0; i<nhogs; i++) {
+		if (waitpid(hogs[i], &status, 0) < 0) {
+			warn("waitpid");
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,90 @@
+/*
+ * zerofill.c
+ *
+ * 	Touch many zero-fill pages, several times as many as the
+ *      kernel keeps pre-zeroed, so that pages are taken from the
+ *      zero pool, the pool runs dry, and pages come from it again
+ *      once the zeroing thread has refilled it. Every page must
+ *      read as zeros the first time it is touched, whether it is
+ *      in the BSS or in the heap.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define PageSize	4096
+#define NumPages	256
+#define Rounds		4
+
+/* BSS pages, touched in the first round */
+char bss[NumPages*PageSize];
+
+static
+int
+check_page(const char *p, int page)
+{
+	int i;
+
+	for (i=0; i<PageSize; i+=sizeof(int)) {
+		if (*(const int *)(p+i) != 0) {
+			printf("Test failed! Page %d not zero at offset %d\n",
+			       page, i);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static
+int
+fill(char *base, int round)
+{
+	int i;
+
+	for (i=0; i<NumPages; i++) {
+		if (check_page(base + i*PageSize, i)) {
+			return 1;
+		}
+		base[i*PageSize] = 'a' + round;
+		base[i*PageSize + PageSize - 1] = 'z' - round;
+	}
+	for (i=0; i<NumPages; i++) {
+		if (base[i*PageSize] != 'a' + round ||
+		    base[i*PageSize + PageSize - 1] != 'z' - round) {
+			printf("Test failed! Page %d lost its contents\n", i);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int
+main()
+{
+	char *heap;
+	int r;
+
+	printf("Starting the zerofill program\n");
+
+	if (fill(bss, 0)) {
+		return 1;
+	}
+	printf("round [0] done\n");
+
+	/* the heap only grows, so each round gets fresh pages */
+	for (r=1; r<Rounds; r++) {
+		heap = sbrk(NumPages*PageSize);
+		if (heap == (void *)-1) {
+			printf("Test failed! sbrk\n");
+			return 1;
+		}
+		if (fill(heap, r)) {
+			return 1;
+		}
+		printf("round [%d] done\n", r);
+	}
+
+	printf("SUCCESS\n");
+	return 0;
+}